@@ -0,0 +1,131 @@
+#pragma once
+
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <moveit_drake/ktopt_moveit_parameters.hpp>
+
+// relevant drake includes
+#include <drake/geometry/geometry_ids.h>
+#include <drake/geometry/meshcat.h>
+#include <drake/geometry/meshcat_visualizer.h>
+#include <drake/geometry/scene_graph.h>
+#include <drake/multibody/parsing/package_map.h>
+#include <drake/multibody/plant/multibody_plant.h>
+#include <drake/systems/framework/diagram.h>
+
+#include <ktopt_interface/visualization_worker.hpp>
+
+namespace ktopt_interface
+{
+/**
+ * @brief Robot-only Drake model that is built once per robot description and shared between planning contexts.
+ * @details The diagram is finalized and never modified after construction. Planning scene geometry is registered in
+ * the per-context diagram context (see KTOptPlanningContext::transcribePlanningScene), so that a single model can
+ * serve any number of planning contexts concurrently.
+ */
+struct DrakeModel
+{
+  /// @brief Hands the diagram to the visualization worker, which releases it before the Meshcat instance.
+  ~DrakeModel();
+
+  /// @brief The Drake diagram describing the robot system.
+  std::unique_ptr<drake::systems::Diagram<double>> diagram;
+
+  /// @brief The finalized multibody plant inside the diagram.
+  const drake::multibody::MultibodyPlant<double>* plant = nullptr;
+
+  /// @brief The scene graph inside the diagram.
+  const drake::geometry::SceneGraph<double>* scene_graph = nullptr;
+
+  /// @brief The geometry source under which planning scene objects are registered.
+  drake::geometry::SourceId planning_scene_source_id;
+
+  /// @brief The Drake MeshCat visualizer associated with this model, only set if visualization is enabled.
+  /// @details It must only be used from jobs posted to the visualization worker.
+  drake::geometry::MeshcatVisualizer<double>* visualizer = nullptr;
+
+  /// @brief The worker owning the Meshcat instance, only set if visualization is enabled.
+  /// @details Declared last, so that it is stopped before any of the systems its jobs use are destroyed. Every
+  /// reference to the Meshcat instance is released on its thread.
+  std::unique_ptr<VisualizationWorker> visualization_worker;
+};
+
+/**
+ * @brief Creates the key identifying the parameters a model of a robot description is built with.
+ * @param params The ROS parameters for this planner.
+ * @return Equal keys for parameters that result in the same model.
+ */
+[[nodiscard]] std::string makeModelParamsKey(const ktopt_interface::Params& params);
+
+/**
+ * @brief Builds a new robot-only Drake model.
+ * @param robot_description The URDF string containing the robot description.
+ * @param params The ROS parameters for this planner.
+ * @param package_map Packages to resolve in addition to Drake's default ones, e.g. from
+ * DrakeModelCache::getPackageMap().
+ * @return The finalized model.
+ */
+[[nodiscard]] std::shared_ptr<const DrakeModel> buildDrakeModel(const std::string& robot_description,
+                                                                const ktopt_interface::Params& params,
+                                                                const drake::multibody::PackageMap& package_map);
+
+/**
+ * @brief Process-wide cache of Drake models, keyed by robot description and the parameters that affect the build.
+ */
+class DrakeModelCache
+{
+public:
+  /**
+   * @brief Returns the model for the given robot description, building it on first use.
+   * @details Only requests for a model that is currently being built wait for that build.
+   * @param robot_description The URDF string containing the robot description.
+   * @param params The ROS parameters for this planner.
+   * @return The cached or newly built model.
+   */
+  [[nodiscard]] std::shared_ptr<const DrakeModel> getModel(const std::string& robot_description,
+                                                           const ktopt_interface::Params& params);
+
+  /**
+   * @brief Returns the packages found in the given folders.
+   * @details Crawling the folders for package.xml files can be slow, e.g. on network mounts, so the result is kept
+   * and the folders are only crawled again when the list of folders changes.
+   * @param package_folders The folders to search for packages, usually the external_robot_description parameter.
+   * @return The package map.
+   */
+  [[nodiscard]] std::shared_ptr<const drake::multibody::PackageMap>
+  getPackageMap(const std::vector<std::string>& package_folders);
+
+  /**
+   * @brief Drops the cached models of a robot description, e.g. after it has been replaced by a new one.
+   * @details Models that are still in use stay alive until released.
+   * @param robot_description The URDF string containing the robot description.
+   */
+  void evict(const std::string& robot_description);
+
+  /// @brief Drops all cached models. Models that are still in use stay alive until released.
+  void clear();
+
+private:
+  /// @brief Protects the package map and the folders it was built from.
+  std::mutex package_map_mutex_;
+
+  /// @brief The folders the package map was built from.
+  std::vector<std::string> package_folders_;
+
+  /// @brief The packages found in package_folders_, or nullptr if no map has been built yet.
+  std::shared_ptr<const drake::multibody::PackageMap> package_map_;
+
+  /// @brief Protects the cached models.
+  std::mutex mutex_;
+
+  /// @brief Cached models by robot description and by the parameters they were built with, set once built.
+  std::unordered_map<std::string,
+                     std::unordered_map<std::string, std::shared_future<std::shared_ptr<const DrakeModel>>>>
+      models_;
+};
+}  // namespace ktopt_interface
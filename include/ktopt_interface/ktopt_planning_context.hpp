@@ -1,14 +1,37 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <moveit/collision_detection/world.hpp>
 #include <moveit/planning_interface/planning_interface.hpp>
 #include <moveit_drake/ktopt_moveit_parameters.hpp>
 #include <shape_msgs/msg/solid_primitive.h>
 
+#include <ktopt_interface/drake_model_cache.hpp>
+#include <ktopt_interface/path_samples_constraint.hpp>
+#include <moveit/drake/conversions.hpp>
+#include <ktopt_interface/thread_pool.hpp>
+
 // relevant drake includes
+#include <drake/geometry/collision_filter_manager.h>
 #include <drake/geometry/meshcat.h>
 #include <drake/geometry/meshcat_visualizer.h>
 #include <drake/geometry/scene_graph.h>
+#include <drake/common/trajectories/bspline_trajectory.h>
+#include <drake/common/trajectories/trajectory.h>
 #include <drake/planning/trajectory_optimization/kinematic_trajectory_optimization.h>
+#include <drake/solvers/mathematical_program.h>
+#include <drake/solvers/mathematical_program_result.h>
+#include <drake/solvers/solver_interface.h>
 #include <drake/systems/framework/diagram.h>
 #include <drake/systems/framework/diagram_builder.h>
 #include <drake/multibody/parsing/parser.h>
@@ -24,6 +47,33 @@ using drake::systems::Diagram;
 using drake::systems::DiagramBuilder;
 using Joints = std::vector<const moveit::core::JointModel*>;
 
+/// @brief Process-wide counters of the planning scene fingerprint cache.
+struct SceneCacheStatistics
+{
+  /// @brief Number of transcriptions skipped because the scene was unchanged.
+  std::size_t hits = 0;
+
+  /// @brief Number of transcriptions that had to update the scene graph context.
+  std::size_t misses = 0;
+};
+
+/// @brief Receives the compact B-spline of a successful solve, together with the request it answers.
+using BsplineTrajectoryCallback = std::function<void(const planning_interface::MotionPlanRequest& request,
+                                                     const moveit::drake::BsplineTrajectoryData& bspline_trajectory)>;
+
+/// @brief The collisions an allowed collision matrix always allows, by the names of links and world objects.
+struct AllowedCollisions
+{
+  /// @brief Pairs of names without default entry whose explicit entry allows them to collide.
+  std::vector<std::pair<std::string, std::string>> pairs;
+
+  /// @brief Names whose default entry allows them to collide with every name that has no other default entry.
+  std::vector<std::string> always_allowed_names;
+
+  /// @brief Names whose default entry does not always allow collisions, which takes precedence over the above.
+  std::vector<std::string> restricted_names;
+};
+
 /**
  * @brief Helper class that defines a planning context for Drake Kinematic Trajectory Optimization (KTOpt).
  * @details For more information, refer to the Drake documentation:
@@ -56,69 +106,259 @@ public:
 
   /**
    * @brief Terminates any running solutions.
+   * @details No further solve stage is started. NLopt stages are aborted at their next iterate. SNOPT and IPOPT cannot
+   * be interrupted safely from their callbacks, so a running SNOPT or IPOPT stage only ends at its native time limit,
+   * i.e. after at most solver_time_limit seconds or at the deadline of the request, whichever comes first. The flag is
+   * reset by clear().
    * @return True if successful, otherwise false.
    */
   bool terminate() override;
 
   /// @brief Clear the data structures used by the planner.
+  /// @details Drops the references to the current request and planning scene. The Drake model, the diagram context
+  /// and the transcribed scene are kept, so that the context can be reused for the next request.
   void clear() override;
 
   /**
-   * @brief Sets the current robot description for planning.
-   * @param robot_description The URDF string containing the robot description.
+   * @brief Sets the ROS parameters used for the next request.
+   * @details If the parameters change how meshes are transcribed, the transcribed planning scene is discarded and the
+   * next request transcribes it again.
+   * @param params The ROS parameters for this planner.
+   */
+  void setParams(const ktopt_interface::Params& params);
+
+  /**
+   * @brief Sets the thread pool used to solve multiple goal samples and starts in parallel.
+   * @param thread_pool The thread pool, or nullptr to solve sequentially.
+   */
+  void setThreadPool(const std::shared_ptr<ThreadPool>& thread_pool);
+
+  /**
+   * @brief Sets the joint group used for the next request.
+   * @param group_name The name of the joint group used for motion planning.
+   */
+  void setGroupName(const std::string& group_name);
+
+  /**
+   * @brief Sets the Drake robot model used for planning and transcribes the current planning scene into it.
+   * @details The diagram context is only recreated if the model differs from the one set previously.
+   * @param model The shared robot-only model, usually obtained from a DrakeModelCache.
+   */
+  void setDrakeModel(const std::shared_ptr<const DrakeModel>& model);
+
+  /**
+   * @brief Returns the Drake robot model used for planning.
+   * @return The model, or nullptr if none has been set yet.
    */
-  void setRobotDescription(const std::string& robot_description);
+  [[nodiscard]] const std::shared_ptr<const DrakeModel>& getDrakeModel() const;
 
   /**
-   * @brief Transcribes a MoveIt planning scene to the Drake multibody plant used by this planner.
+   * @brief Transcribes a MoveIt planning scene to the Drake scene graph context used by this planner.
+   * @details The geometry is registered in this context's diagram context, the shared model is left untouched.
+   * If the content hash of the world and the allowed collision matrix matches the previously transcribed scene,
+   * nothing is done. Otherwise, objects transcribed by a previous call are diffed against the MoveIt world by object
+   * id, so that only added, removed, moved or reshaped objects touch the scene graph.
    * @param planning_scene The MoveIt planning scene to transcribe.
    */
   void transcribePlanningScene(const planning_scene::PlanningScene& planning_scene);
 
+  /**
+   * @brief Returns the content hash of the planning scene currently transcribed into this context.
+   * @return The scene fingerprint, or std::nullopt if no scene has been transcribed yet.
+   */
+  [[nodiscard]] std::optional<std::size_t> getSceneFingerprint() const;
+
+  /**
+   * @brief Returns the process-wide hit and miss counters of the planning scene fingerprint cache.
+   * @return The current counters.
+   */
+  [[nodiscard]] static SceneCacheStatistics getSceneCacheStatistics();
+
+  /**
+   * @brief Sets the process-wide callback that receives the compact B-spline of every successful solve.
+   * @details The callback runs on the planning thread before solve() returns, in addition to the dense trajectory of
+   * the response, e.g. for controllers that execute B-splines directly. getRobotTrajectory() turns the B-spline back
+   * into waypoints on demand.
+   * @param callback The callback, or an empty function to stop handing out B-splines.
+   */
+  static void setBsplineTrajectoryCallback(BsplineTrajectoryCallback callback);
+
   /**
    * @brief Adds path position constraints, if any, to the planning problem.
    * @param trajopt The Drake object containing the trajectory optimization problem.
    * @param plant The Drake multibody plant to use for planning.
-   * @param plant_context The context associated with the multibody plant.
+   * @param sample_contexts The diagram contexts the constraints are evaluated in, one per path sample.
    * @param padding Additional position padding on the MoveIt constraint, in meters.
    * This ensures that constraints are more likely to hold for the entire trajectory, since the
    * Drake mathematical program only optimizes constraints at discrete points along the path.
    */
   void addPathPositionConstraints(KinematicTrajectoryOptimization& trajopt, const MultibodyPlant<double>& plant,
-                                  Context<double>& plant_context, const double padding);
+                                  PathSampleContexts& sample_contexts, const double padding) const;
 
   /**
    * @brief Adds path orientation constraints, if any, to the planning problem.
    * @param trajopt The Drake object containing the trajectory optimization problem.
    * @param plant The Drake multibody plant to use for planning.
-   * @param plant_context The context associated with the multibody plant.
+   * @param sample_contexts The diagram contexts the constraints are evaluated in, one per path sample.
    * @param padding Additional orientation padding on the MoveIt constraint, in radians.
    * This ensures that constraints are more likely to hold for the entire trajectory, since the
    * Drake mathematical program only optimizes constraints at discrete points along the path.
    */
   void addPathOrientationConstraints(KinematicTrajectoryOptimization& trajopt, const MultibodyPlant<double>& plant,
-                                     Context<double>& plant_context, const double padding);
+                                     PathSampleContexts& sample_contexts, const double padding) const;
 
 private:
-  /// @brief The ROS parameters associated with this motion planner.
-  const ktopt_interface::Params params_;
+  /// @brief The outcome of solving the planning problem from one start.
+  struct KTOptSolution
+  {
+    /// @brief The optimal cost of the collision constrained problem.
+    double cost = std::numeric_limits<double>::infinity();
+
+    /// @brief The optimized trajectory, only set if both solve stages succeeded.
+    std::optional<drake::trajectories::BsplineTrajectory<double>> trajectory;
+  };
+
+  /// @brief Cancellation state of one solve attempt, checked from its solver callback.
+  struct SolveAttempt
+  {
+    /// @brief The point in time at which the running solve stage runs out of its time limit.
+    std::chrono::steady_clock::time_point stage_deadline = std::chrono::steady_clock::time_point::max();
+
+    /// @brief Optional flag that is set once this attempt is no longer needed.
+    const std::atomic<bool>* abandoned = nullptr;
+
+    /// @brief Whether the running solver has no native time limit, so that the solver callback has to stop it.
+    bool stop_from_callback = false;
+  };
 
-  /// @brief The Drake diagram describing the entire system.
-  std::unique_ptr<Diagram<double>> diagram_;
+  /**
+   * @brief Adds a constraint on the joint positions at several path parameters, evaluated by a single
+   * PathSamplesConstraint.
+   * @param trajopt The Drake object containing the trajectory optimization problem.
+   * @param sample_contexts The diagram contexts the constraint is evaluated in, one per path sample.
+   * @param path_parameters The path parameters in [0, 1] at which to evaluate the constraint.
+   * @param make_sample_constraint Creates the constraint of each path sample.
+   */
+  void addPathSamplesConstraint(KinematicTrajectoryOptimization& trajopt, PathSampleContexts& sample_contexts,
+                                const std::vector<double>& path_parameters,
+                                const PathSamplesConstraint::SampleConstraintFactory& make_sample_constraint) const;
+
+  /**
+   * @brief Sets up and solves both stages of the planning problem from one start.
+   * @param start_state The start state of the trajectory.
+   * @param goal_state The goal state of the trajectory.
+   * @param start_index The index of the start, which selects the initial guess.
+   * @param sample_contexts The diagram contexts used by this start and the samples of its constraints.
+   * @param initial_stage_solver The solver of the stage without collision constraints.
+   * @param collision_stage_solver The solver of the collision constrained stage.
+   * @param abandoned Optional flag that aborts this start when set.
+   * @return The solution, without trajectory if the problem could not be solved.
+   */
+  [[nodiscard]] KTOptSolution solveFromStart(const moveit::core::RobotState& start_state,
+                                             const moveit::core::RobotState& goal_state, std::size_t start_index,
+                                             PathSampleContexts& sample_contexts,
+                                             const drake::solvers::SolverInterface& initial_stage_solver,
+                                             const drake::solvers::SolverInterface& collision_stage_solver,
+                                             const std::atomic<bool>* abandoned) const;
+
+  /// @brief Bookkeeping for a MoveIt world object that has been transcribed into the scene graph context.
+  struct TranscribedObject
+  {
+    /// @brief The MoveIt shapes of the object at transcription time.
+    std::vector<shapes::ShapeConstPtr> shapes;
+
+    /// @brief The global poses of the shapes at transcription time.
+    EigenSTL::vector_Isometry3d shape_poses;
+
+    /// @brief The registered geometry per shape, invalid for unsupported shapes.
+    std::vector<drake::geometry::GeometryId> geometry_ids;
+  };
+
+  /**
+   * @brief Checks whether the current solve should be abandoned.
+   * @return True if terminate() was called or the allowed planning time of the request has passed.
+   */
+  [[nodiscard]] bool isCancelled() const;
+
+  /**
+   * @brief Sets the error code of a cancelled solve.
+   * @param res The response to update.
+   */
+  void setCancelledErrorCode(planning_interface::MotionPlanResponse& res) const;
+
+  /**
+   * @brief Solves a mathematical program with the configured solver options and time limit.
+   * @details Nothing is solved if the attempt has already been cancelled or abandoned.
+   * @param prog The program to solve.
+   * @param solver The solver to use.
+   * @param attempt The cancellation state checked by the program's solver callback, its stage deadline is updated.
+   * @return The solver result, which is unsuccessful if the solve was cancelled or ran out of time.
+   */
+  [[nodiscard]] drake::solvers::MathematicalProgramResult solveProgram(const drake::solvers::MathematicalProgram& prog,
+                                                                       const drake::solvers::SolverInterface& solver,
+                                                                       SolveAttempt& attempt) const;
+
+  /**
+   * @brief Publishes the current scene, and optionally a trajectory animation, to Meshcat in the background.
+   * @details Does nothing if the model was built without visualization. The data is copied, so this returns
+   * immediately and the visualization never holds up planning.
+   * @param trajectory The trajectory to animate, or nullptr to only publish the current scene.
+   */
+  void visualize(const drake::trajectories::Trajectory<double>* trajectory) const;
+
+  /**
+   * @brief Removes the geometry of a transcribed object from the scene graph context.
+   * @param transcribed_object The object to remove.
+   */
+  void removeTranscribedObject(const TranscribedObject& transcribed_object);
+
+  /**
+   * @brief Filters the collisions the allowed collision matrix allows from the scene graph context.
+   * @details Names of the matrix are matched to plant bodies and transcribed world objects, every pair that is always
+   * allowed to collide is excluded from signed distance queries. Replaces the filter applied before.
+   * @param allowed_collisions The collisions that the allowed collision matrix always allows.
+   */
+  void applyAllowedCollisionMatrix(const AllowedCollisions& allowed_collisions);
+
+  /**
+   * @brief Removes the filter applied by applyAllowedCollisionMatrix() from the scene graph context.
+   */
+  void removeAllowedCollisionFilter();
 
-  /// @brief The builder for the Drake system diagram.
-  std::unique_ptr<DiagramBuilder<double>> builder;
+  /// @brief The ROS parameters associated with this motion planner.
+  ktopt_interface::Params params_;
+
+  /// @brief The shared Drake model describing the robot system.
+  std::shared_ptr<const DrakeModel> model_;
 
   /// @brief The context that contains all the data necessary to perform computations on the diagram.
   std::unique_ptr<Context<double>> diagram_context_;
 
+  /// @brief Copies of diagram_context_ per problem that can be solved at the same time, cleared when it changes.
+  std::vector<std::unique_ptr<PathSampleContexts>> problem_contexts_;
+
+  /// @brief The MoveIt world objects transcribed into the scene graph context, by object id.
+  std::unordered_map<std::string, TranscribedObject> transcribed_objects_;
+
+  /// @brief The content hash of the transcribed planning scene.
+  std::optional<std::size_t> scene_fingerprint_;
+
+  /// @brief The collision filter for the allowed collision matrix in the scene graph context, if any pair is allowed.
+  std::optional<drake::geometry::FilterId> allowed_collision_filter_id_;
+
+  /// @brief Set by terminate() to abort the running solve.
+  std::atomic<bool> terminate_requested_{ false };
+
+  /// @brief The point in time at which the running solve runs out of its allowed planning time.
+  std::chrono::steady_clock::time_point deadline_ = std::chrono::steady_clock::time_point::max();
+
+  /// @brief The thread pool used to solve multiple goal samples and starts in parallel.
+  std::shared_ptr<ThreadPool> thread_pool_;
+
   /// @brief The nominal joint configuration of the robot, used for joint centering objectives.
   Eigen::VectorXd nominal_q_;
 
-  /// @brief Pointer to the Meshcat instance associated with this planner.
-  std::shared_ptr<drake::geometry::Meshcat> meshcat_;
-
-  /// @brief The Drake MeshCat visualizer associated with this planner.
-  drake::geometry::MeshcatVisualizer<double>* visualizer_;
+  /// @brief Mapping between the planning group and the plant, rebuilt when either of them changes.
+  std::optional<moveit::drake::JointIndexMap> joint_index_map_;
 };
 }  // namespace ktopt_interface
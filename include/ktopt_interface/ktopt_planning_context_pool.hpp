@@ -0,0 +1,91 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <moveit_drake/ktopt_moveit_parameters.hpp>
+
+#include <ktopt_interface/ktopt_planning_context.hpp>
+
+namespace ktopt_interface
+{
+/**
+ * @brief Bounded pool of reusable KTOpt planning contexts.
+ * @details Contexts are checked out per request and automatically returned to the pool once the last reference to
+ * them is released, keeping their diagram context and transcribed planning scene for the next request. At most
+ * `max_size` contexts are retained. When all of them are checked out, additional contexts are created on demand and
+ * discarded after use. Idle contexts hold on to the Drake model they were last used with, so they are dropped as soon
+ * as a context is acquired for a different model, which frees replaced models.
+ */
+class KTOptPlanningContextPool : public std::enable_shared_from_this<KTOptPlanningContextPool>
+{
+public:
+  /**
+   * @brief Constructs an empty pool.
+   * @param max_size The maximum number of retained contexts.
+   */
+  explicit KTOptPlanningContextPool(std::size_t max_size);
+
+  /**
+   * @brief Checks out a planning context for the given joint group.
+   * @details Idle contexts last used with a model other than the given one are dropped.
+   * @param group_name The name of the joint group used for motion planning.
+   * @param params The ROS parameters for this planner.
+   * @param model The Drake model the context is going to be used with.
+   * @return A planning context which returns to the pool when released.
+   */
+  [[nodiscard]] std::shared_ptr<KTOptPlanningContext> acquire(const std::string& group_name,
+                                                              const ktopt_interface::Params& params,
+                                                              const std::shared_ptr<const DrakeModel>& model);
+
+  /**
+   * @brief Drops idle contexts last used with a model other than the given one, e.g. after the model was replaced.
+   * @param model The Drake model that is currently in use.
+   */
+  void dropIdleContexts(const std::shared_ptr<const DrakeModel>& model);
+
+  /**
+   * @brief Sets the maximum number of retained contexts. Surplus idle contexts are dropped immediately.
+   * @param max_size The maximum number of retained contexts.
+   */
+  void setMaxSize(std::size_t max_size);
+
+private:
+  /**
+   * @brief Returns a context to the pool, or destroys it if it is not retained.
+   * @param context The context to release.
+   * @param pooled Whether the context counts towards the retained contexts.
+   */
+  void release(KTOptPlanningContext* context, bool pooled);
+
+  /**
+   * @brief Removes idle contexts until the number of retained contexts does not exceed the maximum. Requires mutex_
+   * to be held.
+   * @param dropped The removed contexts, destroyed by the caller after releasing the lock.
+   */
+  void shrink(std::vector<std::unique_ptr<KTOptPlanningContext>>& dropped);
+
+  /**
+   * @brief Removes idle contexts last used with a model other than the given one. Requires mutex_ to be held.
+   * @param model The Drake model that is currently in use.
+   * @param dropped The removed contexts, destroyed by the caller after releasing the lock.
+   */
+  void removeIdleContexts(const std::shared_ptr<const DrakeModel>& model,
+                          std::vector<std::unique_ptr<KTOptPlanningContext>>& dropped);
+
+  /// @brief Protects the pool state.
+  std::mutex mutex_;
+
+  /// @brief The maximum number of retained contexts.
+  std::size_t max_size_;
+
+  /// @brief The number of retained contexts, both idle and checked out.
+  std::size_t num_pooled_ = 0;
+
+  /// @brief Idle contexts by joint group name.
+  std::unordered_map<std::string, std::vector<std::unique_ptr<KTOptPlanningContext>>> idle_contexts_;
+};
+}  // namespace ktopt_interface
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <vector>
+
+#include <drake/common/autodiff.h>
+#include <drake/common/symbolic/expression.h>
+#include <drake/math/bspline_basis.h>
+#include <drake/multibody/plant/multibody_plant.h>
+#include <drake/solvers/constraint.h>
+#include <drake/solvers/decision_variable.h>
+#include <drake/systems/framework/context.h>
+#include <drake/systems/framework/diagram.h>
+
+#include <ktopt_interface/thread_pool.hpp>
+
+namespace ktopt_interface
+{
+/**
+ * @brief Copies of a diagram context for one planning problem and the samples of its PathSamplesConstraints.
+ * @details Cloning a diagram context copies the whole scene graph state, which is expensive for large scenes. The
+ * sample with index i of every constraint of a problem is evaluated in sample context i, which is safe since solvers
+ * evaluate the constraints of a program one after another. The copies remain valid as long as the diagram context
+ * they were copied from does not change, so they can be reused across solves of the same scene.
+ */
+class PathSampleContexts
+{
+public:
+  /**
+   * @brief Copies the diagram context of the problem, the sample contexts are copied on first use.
+   * @param diagram_context The diagram context to copy, including the transcribed planning scene.
+   */
+  explicit PathSampleContexts(const drake::systems::Context<double>& diagram_context);
+
+  /**
+   * @brief Returns the problem's own copy of the diagram context, which no sample is evaluated in.
+   * @return The diagram context.
+   */
+  drake::systems::Context<double>& getDiagramContext();
+
+  /**
+   * @brief Returns the diagram context of a sample, copying the problem's diagram context if it does not exist yet.
+   * @param sample_index The index of the sample within its constraint.
+   * @return The sample's diagram context.
+   */
+  drake::systems::Context<double>& getSampleContext(std::size_t sample_index);
+
+private:
+  /// @brief The problem's own copy of the diagram context.
+  std::unique_ptr<drake::systems::Context<double>> diagram_context_;
+
+  /// @brief The diagram contexts of the samples, by sample index.
+  std::vector<std::unique_ptr<drake::systems::Context<double>>> sample_contexts_;
+};
+
+/**
+ * @brief Constraint on the joint positions at several path parameters of a KinematicTrajectoryOptimization path,
+ * evaluated in a single call.
+ * @details Binding one constraint per path parameter makes the solver pay the binding overhead, and a round trip
+ * through the shared plant context, for every sample. This constraint is bound to all control points instead and
+ * stacks the outputs of its samples. Each sample evaluates its own constraint in its own sample context, and the
+ * gradient sparsity pattern only contains the control points whose basis functions are nonzero at a sample. Since the
+ * samples of a constraint share no state, they can be evaluated in parallel.
+ */
+class PathSamplesConstraint : public drake::solvers::Constraint
+{
+public:
+  /// @brief Creates the constraint of one sample, which is evaluated on the plant positions in the given context.
+  using SampleConstraintFactory =
+      std::function<std::shared_ptr<drake::solvers::Constraint>(drake::systems::Context<double>* plant_context)>;
+
+  /**
+   * @brief Creates the constraint of each sample in the sample context with the same index.
+   * @param diagram The diagram containing the plant.
+   * @param plant The plant whose positions are constrained.
+   * @param sample_contexts The diagram contexts of the problem's samples, which must outlive this constraint.
+   * @param basis The B-spline basis of the path, see KinematicTrajectoryOptimization::basis().
+   * @param path_parameters The path parameters in [0, 1] of the samples.
+   * @param make_sample_constraint Creates the constraint of each sample.
+   * @param thread_pool The thread pool to evaluate the samples on, or nullptr to evaluate them sequentially.
+   */
+  PathSamplesConstraint(const drake::systems::Diagram<double>& diagram,
+                        const drake::multibody::MultibodyPlant<double>& plant, PathSampleContexts& sample_contexts,
+                        const drake::math::BsplineBasis<double>& basis, const std::vector<double>& path_parameters,
+                        const SampleConstraintFactory& make_sample_constraint,
+                        std::shared_ptr<ThreadPool> thread_pool = nullptr);
+
+  /**
+   * @brief Returns the decision variables to bind this constraint to.
+   * @param control_points The control points of the path, see KinematicTrajectoryOptimization::control_points().
+   * @return The control points stacked into a vector, in the order this constraint expects them.
+   */
+  [[nodiscard]] static drake::solvers::VectorXDecisionVariable
+  getVariables(const drake::solvers::MatrixXDecisionVariable& control_points);
+
+private:
+  /// @brief The constraint at one path parameter.
+  struct Sample
+  {
+    /// @brief The constraint on the plant positions at this sample.
+    std::shared_ptr<drake::solvers::Constraint> constraint;
+
+    /// @brief The control points whose basis functions are nonzero at the path parameter.
+    std::vector<int> control_point_indices;
+
+    /// @brief The values of these basis functions at the path parameter.
+    std::vector<double> basis_values;
+
+    /// @brief The index of the sample's first output in the stacked output.
+    int output_offset = 0;
+  };
+
+  /// @brief The samples and their stacked bounds, built before the base class is constructed.
+  struct Samples
+  {
+    std::vector<Sample> samples;
+    Eigen::VectorXd lower_bound;
+    Eigen::VectorXd upper_bound;
+  };
+
+  PathSamplesConstraint(int num_positions, int num_control_points, Samples&& samples,
+                        std::shared_ptr<ThreadPool> thread_pool);
+
+  static Samples makeSamples(const drake::systems::Diagram<double>& diagram,
+                             const drake::multibody::MultibodyPlant<double>& plant,
+                             PathSampleContexts& sample_contexts, const drake::math::BsplineBasis<double>& basis,
+                             const std::vector<double>& path_parameters,
+                             const SampleConstraintFactory& make_sample_constraint);
+
+  void DoEval(const Eigen::Ref<const Eigen::VectorXd>& x, Eigen::VectorXd* y) const override;
+
+  void DoEval(const Eigen::Ref<const drake::AutoDiffVecXd>& x, drake::AutoDiffVecXd* y) const override;
+
+  void DoEval(const Eigen::Ref<const drake::VectorX<drake::symbolic::Variable>>& x,
+              drake::VectorX<drake::symbolic::Expression>* y) const override;
+
+  /**
+   * @brief Interpolates the plant positions at a sample from the stacked control points.
+   * @param sample The sample.
+   * @param x The stacked control points.
+   * @param q The plant positions.
+   */
+  void interpolate(const Sample& sample, const Eigen::Ref<const Eigen::VectorXd>& x, Eigen::VectorXd& q) const;
+
+  /**
+   * @brief Calls evaluate(i) for every sample index i, in parallel on idle threads if there is a thread pool.
+   * @param evaluate The evaluation of one sample.
+   */
+  void forEachSample(const std::function<void(std::size_t)>& evaluate) const;
+
+  /// @brief The number of plant positions, i.e. the size of each control point.
+  int num_positions_;
+
+  /// @brief The samples of this constraint.
+  std::vector<Sample> samples_;
+
+  /// @brief The thread pool to evaluate the samples on, or nullptr to evaluate them sequentially.
+  std::shared_ptr<ThreadPool> thread_pool_;
+};
+}  // namespace ktopt_interface
@@ -0,0 +1,80 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace ktopt_interface
+{
+/**
+ * @brief Fixed-size pool of worker threads for parallel loops inside the planner.
+ * @details The thread calling parallelFor() works on the loop as well, so loops may be nested (e.g. a parallel
+ * constraint evaluation inside a parallel multi-start solve) without deadlocking the pool.
+ */
+class ThreadPool
+{
+public:
+  /**
+   * @brief Starts the worker threads.
+   * @param num_threads The number of worker threads. Zero uses one thread per hardware core.
+   */
+  explicit ThreadPool(std::size_t num_threads);
+
+  /// @brief Stops and joins the worker threads.
+  ~ThreadPool();
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  /**
+   * @brief Returns the number of worker threads.
+   * @return The number of worker threads.
+   */
+  [[nodiscard]] std::size_t size() const;
+
+  /**
+   * @brief Calls body(i) for every i in [0, n) and waits until all calls have returned.
+   * @details The iterations are distributed over the idle worker threads and the calling thread. If no worker is idle,
+   * the calling thread runs all iterations itself. If any iteration throws, the remaining iterations still run and the
+   * first exception is rethrown afterwards.
+   * @param n The number of iterations.
+   * @param body The loop body, which must be safe to call concurrently for different indices.
+   */
+  void parallelFor(std::size_t n, const std::function<void(std::size_t)>& body);
+
+private:
+  /**
+   * @brief Runs the loop of parallelFor() on the idle worker threads and the calling thread.
+   * @param n The number of iterations, at least two.
+   * @param body The loop body.
+   * @return False if no worker was idle, in which case no iteration has been run.
+   */
+  bool runOnWorkers(std::size_t n, const std::function<void(std::size_t)>& body);
+
+  /// @brief The worker threads' main loop.
+  void run();
+
+  /// @brief Protects the task queue and the stop flag.
+  std::mutex mutex_;
+
+  /// @brief Signals new tasks or a stop request to the worker threads.
+  std::condition_variable condition_;
+
+  /// @brief The queued tasks.
+  std::deque<std::function<void()>> tasks_;
+
+  /// @brief Whether the worker threads should exit.
+  bool stop_ = false;
+
+  /// @brief The number of workers waiting for a task, only modified with mutex_ held.
+  std::atomic<std::size_t> num_idle_{ 0 };
+
+  /// @brief The worker threads.
+  std::vector<std::thread> threads_;
+};
+}  // namespace ktopt_interface
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#include <drake/geometry/meshcat.h>
+
+namespace ktopt_interface
+{
+/**
+ * @brief Background thread that owns a Meshcat instance and runs all visualization work for it.
+ * @details Meshcat must only be used from the thread that created it. This worker creates the Meshcat instance in its
+ * own thread and executes posted jobs there in order, so that planning threads never block on visualization.
+ */
+class VisualizationWorker
+{
+public:
+  /// @brief Starts the worker thread and creates its Meshcat instance.
+  VisualizationWorker();
+
+  /**
+   * @brief Stops the worker thread. Jobs that have not been started yet are discarded.
+   * @details The discarded jobs and the Meshcat instance are destroyed on the worker thread.
+   */
+  ~VisualizationWorker();
+
+  VisualizationWorker(const VisualizationWorker&) = delete;
+  VisualizationWorker& operator=(const VisualizationWorker&) = delete;
+
+  /**
+   * @brief Returns the Meshcat instance owned by this worker.
+   * @details The instance may be handed to Drake systems, but must only be used from posted jobs.
+   * @return The Meshcat instance.
+   */
+  [[nodiscard]] std::shared_ptr<drake::geometry::Meshcat> getMeshcat() const;
+
+  /**
+   * @brief Queues a job to be executed on the worker thread.
+   * @details The job must own (copies of) all the data it uses. It is destroyed on the worker thread, even if it is
+   * discarded, so it may also be used to release data that references the Meshcat instance.
+   * @param job The job to execute.
+   */
+  void post(std::function<void()> job);
+
+private:
+  /// @brief The worker thread's main loop.
+  void run();
+
+  /// @brief Protects the job queue and the stop flag.
+  std::mutex mutex_;
+
+  /// @brief Signals new jobs or a stop request to the worker thread.
+  std::condition_variable condition_;
+
+  /// @brief The queued jobs.
+  std::deque<std::function<void()>> jobs_;
+
+  /// @brief Whether the worker thread should exit.
+  bool stop_ = false;
+
+  /// @brief The Meshcat instance, created on the worker thread.
+  std::shared_ptr<drake::geometry::Meshcat> meshcat_;
+
+  /// @brief The worker thread.
+  std::thread thread_;
+};
+}  // namespace ktopt_interface
@@ -0,0 +1,125 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2024, PickNik Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of PickNik Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/* Desc: Batched evaluation of B-spline trajectories on dense time grids
+ */
+
+#pragma once
+
+#include <array>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include <drake/common/trajectories/bspline_trajectory.h>
+#include <drake/common/trajectories/trajectory.h>
+
+namespace moveit::drake
+{
+/**
+ * @brief Evaluates a vector valued B-spline trajectory on whole time grids at once
+ *
+ * On every knot span a B-spline of order k is a polynomial of degree k - 1. The sampler converts each span into its
+ * polynomial coefficients once, on construction. Sampling then only walks the (sorted) sample times span by span and
+ * evaluates the polynomials with Horner's scheme. This avoids the virtual per-sample Trajectory::value() calls, the
+ * basis function recursion for every sample and the creation of derivative trajectories.
+ *
+ * All outputs use a joint-major layout with one row per sample and one column per trajectory row, so that the
+ * samples of a joint are contiguous in memory and the inner loops vectorize.
+ */
+class BsplineSampler
+{
+public:
+  /**
+   * @brief Precompute the per-span polynomial coefficients of a trajectory
+   *
+   * @param trajectory Column vector valued B-spline trajectory
+   */
+  explicit BsplineSampler(const ::drake::trajectories::BsplineTrajectory<double>& trajectory);
+
+  /**
+   * @brief Evaluate the trajectory and its first two derivatives at the given times
+   *
+   * Times outside of the trajectory's time span are clamped to it.
+   *
+   * @param times Sample times in ascending order
+   * @param positions If not null, resized to times.size() x rows() and populated with the positions
+   * @param velocities If not null, resized to times.size() x rows() and populated with the first derivative
+   * @param accelerations If not null, resized to times.size() x rows() and populated with the second derivative
+   */
+  void sample(const std::vector<double>& times, Eigen::MatrixXd* positions, Eigen::MatrixXd* velocities = nullptr,
+              Eigen::MatrixXd* accelerations = nullptr) const;
+
+  /**
+   * @brief Get the number of rows of the trajectory, i.e. the number of joints
+   *
+   * @return Number of rows
+   */
+  [[nodiscard]] int rows() const
+  {
+    return rows_;
+  }
+
+private:
+  /// @brief Highest derivative order supported by sample()
+  static constexpr int kMaxDerivativeOrder = 2;
+
+  /// @brief Evaluates one derivative order of all samples in [begin, end), which lie on the span with index span.
+  void sampleSpan(std::size_t span, const std::vector<double>& times, std::size_t begin, std::size_t end,
+                  int derivative_order, Eigen::MatrixXd& output) const;
+
+  int rows_;
+  double start_time_;
+  double end_time_;
+  /// @brief Start times of the non-empty knot spans, or just the start time for a zero-duration spline
+  std::vector<double> span_starts_;
+  /// @brief Per derivative order and span, the polynomial coefficients in the time since the span start, with one row
+  /// per power and one column per joint
+  std::array<std::vector<Eigen::MatrixXd>, kMaxDerivativeOrder + 1> span_coefficients_;
+};
+
+/**
+ * @brief Evaluate the positions and optionally the velocities of a column vector valued trajectory at the given times
+ *
+ * B-spline trajectories are evaluated with a BsplineSampler, all other trajectories through the generic Trajectory
+ * interface. The outputs have the same joint-major layout as BsplineSampler::sample().
+ *
+ * @param trajectory Trajectory to evaluate
+ * @param times Sample times in ascending order
+ * @param positions Resized to times.size() x trajectory.rows() and populated with the positions
+ * @param velocities If not null, resized to times.size() x trajectory.rows() and populated with the velocities
+ */
+void sampleTrajectory(const ::drake::trajectories::Trajectory<double>& trajectory, const std::vector<double>& times,
+                      Eigen::MatrixXd& positions, Eigen::MatrixXd* velocities = nullptr);
+}  // namespace moveit::drake
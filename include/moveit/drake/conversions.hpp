@@ -36,6 +36,11 @@
    Desc: TODO
 */
 
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+
 #include <moveit/planning_scene/planning_scene.hpp>
 #include <moveit/robot_trajectory/robot_trajectory.hpp>
 
@@ -44,11 +49,146 @@
 #include <drake/systems/framework/diagram.h>
 #include <drake/systems/framework/diagram_builder.h>
 #include <drake/multibody/plant/multibody_plant.h>
+#include <drake/common/trajectories/bspline_trajectory.h>
 #include <drake/common/trajectories/trajectory.h>
 #include <drake/common/trajectories/piecewise_polynomial.h>
 
 namespace moveit::drake
 {
+/**
+ * @brief Precomputed mapping between the variables of a MoveIt joint model group and the position and velocity vectors
+ * of a Drake MultibodyPlant
+ *
+ * Looking up Drake joints by name is comparatively expensive, so the conversion functions below accept a map that is
+ * built once per robot model, group and plant. The map stays valid as long as the joint model group and the plant it
+ * was created from are alive.
+ */
+class JointIndexMap
+{
+public:
+  /// @brief Indices of a single active joint of the group
+  struct JointIndices
+  {
+    /// @brief MoveIt joint model
+    const moveit::core::JointModel* joint_model;
+    /// @brief Index of the joint's first variable in the MoveIt robot state
+    int variable_index;
+    /// @brief Index of the joint's first position in the Drake position vector
+    int position_index;
+    /// @brief Index of the joint's first velocity in the Drake velocity vector
+    int velocity_index;
+  };
+
+  /**
+   * @brief Create the mapping for all active joints of a joint model group
+   *
+   * @param joint_model_group Joint model group whose active joints are mapped
+   * @param plant Drake Multibody Plant containing joints with the same names
+   */
+  JointIndexMap(const moveit::core::JointModelGroup* joint_model_group,
+                const ::drake::multibody::MultibodyPlant<double>& plant);
+
+  /**
+   * @brief Get the joint model group this map was created for
+   *
+   * @return Joint model group
+   */
+  [[nodiscard]] const moveit::core::JointModelGroup* getJointModelGroup() const
+  {
+    return joint_model_group_;
+  }
+
+  /**
+   * @brief Get the indices of all active joints of the group
+   *
+   * @return Joint indices in the order of the group's active joint models
+   */
+  [[nodiscard]] const std::vector<JointIndices>& getJointIndices() const
+  {
+    return joint_indices_;
+  }
+
+  /**
+   * @brief Get the size of the Drake position vector
+   *
+   * @return Number of positions of the plant
+   */
+  [[nodiscard]] int getNumPositions() const
+  {
+    return num_positions_;
+  }
+
+  /**
+   * @brief Get the size of the Drake velocity vector
+   *
+   * @return Number of velocities of the plant
+   */
+  [[nodiscard]] int getNumVelocities() const
+  {
+    return num_velocities_;
+  }
+
+  /**
+   * @brief Copy the group's joint positions from a MoveIt robot state into a Drake position vector. Entries of joints
+   * outside the group are left untouched.
+   *
+   * @param moveit_state MoveIt robot state
+   * @param positions Drake position vector of size getNumPositions()
+   */
+  void getPositions(const moveit::core::RobotState& moveit_state, Eigen::Ref<Eigen::VectorXd> positions) const;
+
+  /**
+   * @brief Copy the group's joint velocities from a MoveIt robot state into a Drake velocity vector. Entries of joints
+   * outside the group are left untouched.
+   *
+   * @param moveit_state MoveIt robot state
+   * @param velocities Drake velocity vector of size getNumVelocities()
+   */
+  void getVelocities(const moveit::core::RobotState& moveit_state, Eigen::Ref<Eigen::VectorXd> velocities) const;
+
+  /**
+   * @brief Copy the group's joint positions from a Drake position vector into a MoveIt robot state
+   *
+   * @param positions Drake position vector of size getNumPositions()
+   * @param moveit_state MoveIt robot state to be updated
+   */
+  void setPositions(const Eigen::Ref<const Eigen::VectorXd>& positions, moveit::core::RobotState& moveit_state) const;
+
+  /**
+   * @brief Copy the group's joint velocities from a Drake velocity vector into a MoveIt robot state
+   *
+   * @param velocities Drake velocity vector of size getNumVelocities()
+   * @param moveit_state MoveIt robot state to be updated
+   */
+  void setVelocities(const Eigen::Ref<const Eigen::VectorXd>& velocities, moveit::core::RobotState& moveit_state) const;
+
+private:
+  const moveit::core::JointModelGroup* joint_model_group_;
+  std::vector<JointIndices> joint_indices_;
+  int num_positions_;
+  int num_velocities_;
+};
+
+/**
+ * @brief Get a joint positions vector for a MultibodyPlant from a MoveIt robot state
+ *
+ * @param moveit_state MoveIt Robot state
+ * @param joint_index_map Mapping between the joint group and the Drake Multibody Plant
+ * @return Vector with drake joint positions
+ */
+[[nodiscard]] Eigen::VectorXd getJointPositionVector(const moveit::core::RobotState& moveit_state,
+                                                     const JointIndexMap& joint_index_map);
+
+/**
+ * @brief Get a joint velocities vector for a MultibodyPlant from a MoveIt robot state
+ *
+ * @param moveit_state MoveIt Robot state
+ * @param joint_index_map Mapping between the joint group and the Drake Multibody Plant
+ * @return Vector with drake joint velocities
+ */
+[[nodiscard]] Eigen::VectorXd getJointVelocityVector(const moveit::core::RobotState& moveit_state,
+                                                     const JointIndexMap& joint_index_map);
+
 /**
  * @brief Get a joint positions vector for a MultibodyPlant from a MoveIt robot state
  *
@@ -121,6 +261,46 @@ void getJerkBounds(const moveit::core::JointModelGroup* joint_model_group,
                    const ::drake::multibody::MultibodyPlant<double>& plant, Eigen::VectorXd& lower_jerk_bounds,
                    Eigen::VectorXd& upper_jerk_bounds);
 
+/**
+ * @brief Copy position bounds from the joint model group of a joint index map to Eigen vectors
+ *
+ * @param joint_index_map Mapping between the joint group and the Drake Multibody Plant
+ * @param lower_position_bounds Lower position bounds populated by this function
+ * @param upper_position_bounds Upper position bounds populated by this function
+ */
+void getPositionBounds(const JointIndexMap& joint_index_map, Eigen::VectorXd& lower_position_bounds,
+                       Eigen::VectorXd& upper_position_bounds);
+
+/**
+ * @brief Copy velocity bounds from the joint model group of a joint index map to Eigen vectors
+ *
+ * @param joint_index_map Mapping between the joint group and the Drake Multibody Plant
+ * @param lower_velocity_bounds Lower velocity bounds populated by this function
+ * @param upper_velocity_bounds Upper velocity bounds populated by this function
+ */
+void getVelocityBounds(const JointIndexMap& joint_index_map, Eigen::VectorXd& lower_velocity_bounds,
+                       Eigen::VectorXd& upper_velocity_bounds);
+
+/**
+ * @brief Copy acceleration bounds from the joint model group of a joint index map to Eigen vectors
+ *
+ * @param joint_index_map Mapping between the joint group and the Drake Multibody Plant
+ * @param lower_acceleration_bounds Lower acceleration bounds populated by this function
+ * @param upper_acceleration_bounds Upper acceleration bounds populated by this function
+ */
+void getAccelerationBounds(const JointIndexMap& joint_index_map, Eigen::VectorXd& lower_acceleration_bounds,
+                           Eigen::VectorXd& upper_acceleration_bounds);
+
+/**
+ * @brief Copy jerk bounds from the joint model group of a joint index map to Eigen vectors
+ *
+ * @param joint_index_map Mapping between the joint group and the Drake Multibody Plant
+ * @param lower_jerk_bounds Lower jerk bounds populated by this function
+ * @param upper_jerk_bounds Upper jerk bounds populated by this function
+ */
+void getJerkBounds(const JointIndexMap& joint_index_map, Eigen::VectorXd& lower_jerk_bounds,
+                   Eigen::VectorXd& upper_jerk_bounds);
+
 /**
  * @brief Create a Piecewise Polynomial from a moveit trajectory (see
  * https://drake.mit.edu/doxygen_cxx/classdrake_1_1trajectories_1_1_piecewise_polynomial.html)
@@ -149,10 +329,127 @@ void getRobotTrajectory(const ::drake::trajectories::Trajectory<double>& drake_t
                         std::shared_ptr<::robot_trajectory::RobotTrajectory>& moveit_trajectory);
 
 /**
- * @brief Converts all STL file paths in a URDF string to OBJ file paths
+ * @brief Create a moveit trajectory from a drake trajectory. Assumes that the drake trajectory describes a joint
+ * trajectory for the full position vector of the plant the joint index map was created for.
+ *
+ * @param drake_trajectory Drake trajectory
+ * @param delta_t Time step size
+ * @param joint_index_map Mapping between the trajectory's joint group and the Drake Multibody Plant
+ * @param moveit_trajectory MoveIt trajectory to be populated based on the drake trajectory
+ */
+void getRobotTrajectory(const ::drake::trajectories::Trajectory<double>& drake_trajectory, const double delta_t,
+                        const JointIndexMap& joint_index_map,
+                        std::shared_ptr<::robot_trajectory::RobotTrajectory>& moveit_trajectory);
+
+/**
+ * @brief Create a moveit trajectory from a drake trajectory, with waypoints at the given times
+ *
+ * @param drake_trajectory Drake trajectory
+ * @param times Waypoint times in ascending order, starting at zero
+ * @param joint_index_map Mapping between the trajectory's joint group and the Drake Multibody Plant
+ * @param moveit_trajectory MoveIt trajectory to be populated based on the drake trajectory
+ */
+void getRobotTrajectory(const ::drake::trajectories::Trajectory<double>& drake_trajectory,
+                        const std::vector<double>& times, const JointIndexMap& joint_index_map,
+                        std::shared_ptr<::robot_trajectory::RobotTrajectory>& moveit_trajectory);
+
+/**
+ * @brief Compact representation of a B-spline joint trajectory, e.g. for controllers that execute B-splines directly
+ *
+ * Only the joints of the planning group are stored, each of them is assumed to be a single DoF joint.
+ */
+struct BsplineTrajectoryData
+{
+  /// @brief Names of the joints, one per row of the control points
+  std::vector<std::string> joint_names;
+  /// @brief Order of the B-spline, i.e. its polynomial degree plus one
+  int order = 0;
+  /// @brief Knot vector, with num_control_points + order entries starting at zero
+  std::vector<double> knots;
+  /// @brief Control points, with one row per joint and one column per control point
+  Eigen::MatrixXd control_points;
+  /// @brief Duration of the trajectory in seconds
+  double duration = 0.0;
+};
+
+/**
+ * @brief Extract the compact representation of a B-spline trajectory for the joints of a group
+ *
+ * @param bspline_trajectory Drake B-spline trajectory over the full position vector of the plant
+ * @param joint_index_map Mapping between the joint group and the Drake Multibody Plant
+ * @return Compact B-spline representation, shifted to start at zero
+ */
+[[nodiscard]] BsplineTrajectoryData
+getBsplineTrajectoryData(const ::drake::trajectories::BsplineTrajectory<double>& bspline_trajectory,
+                         const JointIndexMap& joint_index_map);
+
+/**
+ * @brief Expand a compact B-spline representation into a moveit trajectory with evenly spaced waypoints
+ *
+ * @param bspline_data Compact B-spline representation
+ * @param delta_t Time step size
+ * @param moveit_trajectory MoveIt trajectory to be populated, joints that are not part of the B-spline keep their
+ * default values
+ * @throws std::invalid_argument if a joint of the B-spline is not part of the trajectory's robot model
+ */
+void getRobotTrajectory(const BsplineTrajectoryData& bspline_data, const double delta_t,
+                        std::shared_ptr<::robot_trajectory::RobotTrajectory>& moveit_trajectory);
+
+/**
+ * @brief Get evenly spaced sample times from zero to the end time of a trajectory
+ *
+ * @param drake_trajectory Drake trajectory
+ * @param delta_t Maximum time step size
+ * @return Sample times, including zero and the end time
+ */
+[[nodiscard]] std::vector<double>
+getUniformSampleTimes(const ::drake::trajectories::Trajectory<double>& drake_trajectory, const double delta_t);
+
+/**
+ * @brief Get a reduced set of sample times that still represents a trajectory within a joint space tolerance
+ *
+ * The trajectory is sampled at a fixed time step first. Samples are then dropped (Ramer-Douglas-Peucker) as long as
+ * linear interpolation between the remaining ones deviates from every dense sample by at most the tolerance, in every
+ * joint. Waypoints therefore concentrate where the joint velocities change, while segments of constant velocity are
+ * represented by their end points only.
+ *
+ * @param drake_trajectory Drake trajectory
+ * @param delta_t Time step size of the dense sampling, which is the finest resolution of the result
+ * @param tolerance Maximum joint space deviation of the linear interpolation between the returned samples
+ * @return Sample times in ascending order, including zero and the end time
+ */
+[[nodiscard]] std::vector<double>
+getAdaptiveSampleTimes(const ::drake::trajectories::Trajectory<double>& drake_trajectory, const double delta_t,
+                       const double tolerance);
+
+/**
+ * @brief Check whether a filename ends with an extension, ignoring case
+ *
+ * @param filename Filename or URL
+ * @param extension Lower case extension including the dot, e.g. ".stl"
+ * @return True if the filename ends with the extension
+ */
+[[nodiscard]] bool hasFileExtension(std::string_view filename, std::string_view extension);
+
+/**
+ * @brief Rewrite the filename attributes of all mesh elements in a URDF string
+ *
+ * The description is scanned once and the result is built by appending, so the cost is linear in the size of the
+ * description regardless of the number of meshes. Comments and all other elements and attributes are copied verbatim.
+ *
+ * @param input Input robot description
+ * @param rewrite Called with every mesh filename, returns the replacement or std::nullopt to keep the filename
+ * @return Robot description with rewritten mesh filenames
+ */
+[[nodiscard]] std::string
+rewriteMeshFilenames(const std::string& input,
+                     const std::function<std::optional<std::string>(const std::string& filename)>& rewrite);
+
+/**
+ * @brief Converts all STL mesh file paths in a URDF string to OBJ file paths
  *
  * @param input Input robot description
- * @return std::string Robot description with all STL file paths replaced by OBJ file paths
+ * @return std::string Robot description with all STL mesh file paths (any case) replaced by OBJ file paths
  */
 [[nodiscard]] std::string replaceSTLWithOBJ(const std::string& input);
 }  // namespace moveit::drake
@@ -0,0 +1,100 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2024, PickNik Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of PickNik Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/* Desc: Conversion of STL meshes referenced by robot descriptions and of planning scene meshes to cached OBJ files
+ */
+
+#pragma once
+
+#include <filesystem>
+#include <string>
+
+#include <drake/multibody/parsing/package_map.h>
+#include <geometric_shapes/shapes.h>
+
+namespace moveit::drake
+{
+/**
+ * @brief Get the default directory of the converted mesh cache
+ *
+ * @return $XDG_CACHE_HOME/moveit_drake/meshes, or ~/.cache/moveit_drake/meshes if XDG_CACHE_HOME is not set
+ */
+[[nodiscard]] std::filesystem::path getDefaultMeshCacheDirectory();
+
+/**
+ * @brief Convert an STL file (binary or ASCII) to an OBJ file in the mesh cache
+ *
+ * The OBJ file is named after a hash of the STL content, so identical meshes share one cache entry and a changed mesh
+ * never hits a stale one. A small index entry per source file remembers the hash of its last seen size and
+ * modification time, so that unchanged meshes are not read again on later runs.
+ *
+ * @param stl_path Path of the STL file
+ * @param cache_directory Directory of the mesh cache, created if it does not exist
+ * @return Path of the cached OBJ file
+ * @throws std::runtime_error if the STL file cannot be read or parsed, or the OBJ file cannot be written
+ */
+[[nodiscard]] std::filesystem::path convertSTLToOBJ(const std::filesystem::path& stl_path,
+                                                    const std::filesystem::path& cache_directory);
+
+/**
+ * @brief Replace all STL meshes in a URDF string with cached OBJ conversions
+ *
+ * Mesh filenames are resolved with the given package map. Meshes that cannot be resolved or converted fall back to
+ * replaceSTLWithOBJ() behavior, i.e. an OBJ file with the same name is expected next to the STL file.
+ *
+ * @param input Input robot description
+ * @param package_map Package map used to resolve package:// and file:// URLs
+ * @param cache_directory Directory of the mesh cache
+ * @return Robot description referencing OBJ files only
+ */
+[[nodiscard]] std::string convertSTLMeshesToOBJ(const std::string& input,
+                                                const ::drake::multibody::PackageMap& package_map,
+                                                const std::filesystem::path& cache_directory);
+
+/**
+ * @brief Write a triangle mesh, e.g. of a planning scene object, to an OBJ file in the mesh cache
+ *
+ * Drake loads meshes from files only. The OBJ file is named after a hash of the vertices and triangles, so a mesh that
+ * shows up in many planning scenes is only written once. With convex_hull, the convex hull of the mesh is written to a
+ * second cache entry and returned instead, so it is only computed once per mesh as well.
+ *
+ * @param mesh The mesh to write
+ * @param cache_directory Directory of the mesh cache, created if it does not exist
+ * @param convex_hull Whether to return the convex hull of the mesh instead of the mesh itself
+ * @return Path of the cached OBJ file
+ * @throws std::runtime_error if the mesh is empty, its convex hull is degenerate, or the OBJ file cannot be written
+ */
+[[nodiscard]] std::filesystem::path convertMeshToOBJ(const shapes::Mesh& mesh,
+                                                     const std::filesystem::path& cache_directory, bool convex_hull);
+}  // namespace moveit::drake
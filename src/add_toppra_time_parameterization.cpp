@@ -48,13 +48,7 @@
 #include <drake/multibody/plant/multibody_plant.h>
 #include <drake/multibody/optimization/toppra.h>
 #include <drake/common/trajectories/path_parameterized_trajectory.h>
-
-/* Visualization */
-#include "drake/geometry/meshcat.h"
-#include "drake/geometry/meshcat_visualizer.h"
-#include "drake/geometry/drake_visualizer.h"
-#include "drake/geometry/meshcat_params.h"
-// #include <toppra_parameters.hpp>
+#include <moveit_drake/toppra_parameters.hpp>
 
 namespace moveit::drake
 {
@@ -70,11 +64,6 @@ using ::drake::systems::Diagram;
 using ::drake::systems::DiagramBuilder;
 using ::drake::trajectories::PathParameterizedTrajectory;
 
-using ::drake::geometry::Meshcat;
-using ::drake::geometry::MeshcatParams;
-using ::drake::geometry::MeshcatVisualizer;
-using ::drake::geometry::MeshcatVisualizerParams;
-
 namespace
 {
 rclcpp::Logger getLogger()
@@ -92,10 +81,9 @@ class AddToppraTimeParameterization : public planning_interface::PlanningRespons
 public:
   AddToppraTimeParameterization() = default;
 
-  void initialize(const rclcpp::Node::SharedPtr& /*node*/, const std::string& /*parameter_namespace*/) override
+  void initialize(const rclcpp::Node::SharedPtr& node, const std::string& parameter_namespace) override
   {
-    // TODO
-    // param_listener_ = std::make_unique<toppra_parameters::ParamListener>(node, parameter_namespace);
+    param_listener_ = std::make_unique<toppra_parameters::ParamListener>(node, parameter_namespace);
 
     // Construct diagram
     auto builder = std::make_unique<DiagramBuilder<double>>();
@@ -112,14 +100,6 @@ public:
     // for now finalize plant here
     plant.Finalize();
 
-    const auto meshcat_params = MeshcatParams();
-    meshcat_ = std::make_shared<Meshcat>(meshcat_params);
-
-    MeshcatVisualizerParams meshcat_viz_params;
-    auto& visualizer =
-        MeshcatVisualizer<double>::AddToBuilder(builder.get(), scene_graph, meshcat_, std::move(meshcat_viz_params));
-    visualizer_ = &visualizer;
-
     diagram_ = builder->Build();
     diagram_context_ = diagram_->CreateDefaultContext();
   }
@@ -155,11 +135,12 @@ public:
     // Update Drake plant from MoveIt planning scene
     auto& plant = diagram_->GetDowncastSubsystemByName<MultibodyPlant<double>>("plant");
     auto& plant_context = diagram_->GetMutableSubsystemContext(plant, diagram_context_.get());
+    const JointIndexMap joint_index_map(joint_model_group, plant);
     Eigen::VectorXd q = Eigen::VectorXd::Zero(plant.num_positions() + plant.num_velocities());
     Eigen::VectorXd joint_positions =
-        moveit::drake::getJointPositionVector(res.trajectory->getFirstWayPoint(), joint_model_group->getName(), plant);
+        moveit::drake::getJointPositionVector(res.trajectory->getFirstWayPoint(), joint_index_map);
     Eigen::VectorXd joint_velocities =
-        moveit::drake::getJointVelocityVector(res.trajectory->getFirstWayPoint(), joint_model_group->getName(), plant);
+        moveit::drake::getJointVelocityVector(res.trajectory->getFirstWayPoint(), joint_index_map);
     q << joint_positions, joint_velocities;
     plant.SetPositionsAndVelocities(&plant_context, q);
 
@@ -181,8 +162,8 @@ public:
     Eigen::VectorXd lower_acceleration_limits;
     Eigen::VectorXd upper_acceleration_limits;
 
-    getVelocityBounds(joint_model_group, plant, lower_velocity_limits, upper_velocity_limits);
-    getAccelerationBounds(joint_model_group, plant, lower_acceleration_limits, upper_acceleration_limits);
+    getVelocityBounds(joint_index_map, lower_velocity_limits, upper_velocity_limits);
+    getAccelerationBounds(joint_index_map, lower_acceleration_limits, upper_acceleration_limits);
 
     toppra.AddJointVelocityLimit(lower_velocity_limits, upper_velocity_limits);
     toppra.AddJointAccelerationLimit(lower_acceleration_limits, upper_acceleration_limits);
@@ -200,43 +181,23 @@ public:
         PathParameterizedTrajectory<double>(input_path, time_optimized_path_parameterization.value());
 
     // Transfer optimized trajectory back to moveit trajectory
-    getRobotTrajectory(optimized_trajectory,
-                       optimized_trajectory.end_time() /
-                           res.trajectory->getWayPointCount() /* TODO enable down sampling */,
-                       plant, res.trajectory /* override previous solution with optimal trajectory*/);
-
-    // meshcat experiment
-    auto& vis_context = visualizer_->GetMyContextFromRoot(*diagram_context_);
-    visualizer_->ForcedPublish(vis_context);
-
-    // Visualize the trajectory with Meshcat (uncomment to visualize)
-    // visualizer_->StartRecording();
-    // const auto num_pts = res.trajectory->getWayPointCount();
-    // RCLCPP_INFO_STREAM(getLogger(), "print trajectory");
-    // for (unsigned int i = 0; i < num_pts; ++i)
-    // {
-    //   const auto t_scale = static_cast<double>(i) / static_cast<double>(num_pts - 1);
-    //   const auto t = std::min(t_scale, 1.0) * optimized_trajectory.end_time();
-    //   plant.SetPositions(&plant_context, optimized_trajectory.value(t));
-    //   auto& vis_context = visualizer_->GetMyContextFromRoot(*diagram_context_);
-    //   visualizer_->ForcedPublish(vis_context);
-    //   // Without these sleeps, the visualizer won't give you time to load your browser
-    //   std::this_thread::sleep_for(std::chrono::milliseconds(100));
-    // }
-    // visualizer_->StopRecording();
-    // visualizer_->PublishRecording();
+    const auto params = param_listener_->get_params();
+    const auto times =
+        params.trajectory_sampling == "adaptive" ?
+            getAdaptiveSampleTimes(optimized_trajectory, params.trajectory_time_step,
+                                   params.trajectory_sampling_tolerance) :
+            getUniformSampleTimes(optimized_trajectory,
+                                  optimized_trajectory.end_time() / res.trajectory->getWayPointCount());
+    getRobotTrajectory(optimized_trajectory, times, joint_index_map,
+                       res.trajectory /* override previous solution with optimal trajectory*/);
 
     res.error_code = moveit::core::MoveItErrorCode::SUCCESS;
   }
 
 protected:
-  // std::unique_ptr<default_response_adapter_parameters::ParamListener> param_listener_;
+  std::unique_ptr<toppra_parameters::ParamListener> param_listener_;
   std::unique_ptr<Diagram<double>> diagram_;
   std::unique_ptr<Context<double>> diagram_context_;
-
-  // Optional visualization
-  std::shared_ptr<Meshcat> meshcat_;
-  MeshcatVisualizer<double>* visualizer_;
 };
 
 }  // namespace moveit::drake
@@ -0,0 +1,272 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2024, PickNik Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of PickNik Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/* Desc: Batched evaluation of B-spline trajectories on dense time grids
+ */
+
+#include <algorithm>
+#include <cassert>
+#include <limits>
+
+#include <moveit/drake/bspline_sampler.hpp>
+
+namespace moveit::drake
+{
+namespace
+{
+/**
+ * @brief Compute all derivatives of the non-zero basis functions of a knot span (The NURBS Book, algorithm A2.3)
+ *
+ * @param knots Knot vector
+ * @param span Index of the knot span, knots[span] <= time < knots[span + 1]
+ * @param degree Degree of the basis functions
+ * @param time Time at which the derivatives are evaluated
+ * @return Matrix with the k-th derivative of the basis function span - degree + j in row k and column j
+ */
+Eigen::MatrixXd computeBasisDerivatives(const std::vector<double>& knots, int span, int degree, double time)
+{
+  Eigen::MatrixXd ndu(degree + 1, degree + 1);
+  Eigen::VectorXd left(degree + 1);
+  Eigen::VectorXd right(degree + 1);
+  ndu(0, 0) = 1.0;
+  for (int j = 1; j <= degree; ++j)
+  {
+    left(j) = time - knots[span + 1 - j];
+    right(j) = knots[span + j] - time;
+    double saved = 0.0;
+    for (int r = 0; r < j; ++r)
+    {
+      // Lower triangle holds the knot differences, upper triangle the basis functions
+      ndu(j, r) = right(r + 1) + left(j - r);
+      const double temp = ndu(r, j - 1) / ndu(j, r);
+      ndu(r, j) = saved + right(r + 1) * temp;
+      saved = left(j - r) * temp;
+    }
+    ndu(j, j) = saved;
+  }
+
+  Eigen::MatrixXd derivatives = Eigen::MatrixXd::Zero(degree + 1, degree + 1);
+  derivatives.row(0) = ndu.col(degree).transpose();
+
+  Eigen::MatrixXd a(2, degree + 1);
+  for (int r = 0; r <= degree; ++r)
+  {
+    int s1 = 0;
+    int s2 = 1;
+    a(0, 0) = 1.0;
+    for (int k = 1; k <= degree; ++k)
+    {
+      double d = 0.0;
+      const int rk = r - k;
+      const int pk = degree - k;
+      if (r >= k)
+      {
+        a(s2, 0) = a(s1, 0) / ndu(pk + 1, rk);
+        d = a(s2, 0) * ndu(rk, pk);
+      }
+      const int j1 = rk >= -1 ? 1 : -rk;
+      const int j2 = r - 1 <= pk ? k - 1 : degree - r;
+      for (int j = j1; j <= j2; ++j)
+      {
+        a(s2, j) = (a(s1, j) - a(s1, j - 1)) / ndu(pk + 1, rk + j);
+        d += a(s2, j) * ndu(rk + j, pk);
+      }
+      if (r <= pk)
+      {
+        a(s2, k) = -a(s1, k - 1) / ndu(pk + 1, r);
+        d += a(s2, k) * ndu(r, pk);
+      }
+      derivatives(k, r) = d;
+      std::swap(s1, s2);
+    }
+  }
+
+  double factor = degree;
+  for (int k = 1; k <= degree; ++k)
+  {
+    derivatives.row(k) *= factor;
+    factor *= degree - k;
+  }
+  return derivatives;
+}
+}  // namespace
+
+BsplineSampler::BsplineSampler(const ::drake::trajectories::BsplineTrajectory<double>& trajectory)
+  : rows_(static_cast<int>(trajectory.rows())), start_time_(trajectory.start_time()), end_time_(trajectory.end_time())
+{
+  assert(trajectory.cols() == 1);
+  const auto& knots = trajectory.basis().knots();
+  const auto& control_points = trajectory.control_points();
+  const int order = trajectory.basis().order();
+  const int degree = order - 1;
+  const auto num_control_points = static_cast<int>(control_points.size());
+
+  for (int span = degree; span < num_control_points; ++span)
+  {
+    if (knots[span + 1] <= knots[span])
+    {
+      continue;
+    }
+
+    // The polynomial on this span is exactly its Taylor expansion at the span start
+    const Eigen::MatrixXd basis_derivatives = computeBasisDerivatives(knots, span, degree, knots[span]);
+    Eigen::MatrixXd coefficients = Eigen::MatrixXd::Zero(order, rows_);
+    double factorial = 1.0;
+    for (int k = 0; k <= degree; ++k)
+    {
+      factorial *= std::max(k, 1);
+      for (int j = 0; j <= degree; ++j)
+      {
+        coefficients.row(k) += (basis_derivatives(k, j) / factorial) * control_points[span - degree + j].transpose();
+      }
+    }
+
+    // Differentiating the polynomial shifts its coefficients down by one power
+    span_starts_.push_back(knots[span]);
+    for (int derivative_order = 0; derivative_order <= kMaxDerivativeOrder; ++derivative_order)
+    {
+      span_coefficients_[derivative_order].push_back(coefficients);
+      const auto num_coefficients = coefficients.rows();
+      if (num_coefficients > 0)
+      {
+        Eigen::MatrixXd derivative(num_coefficients - 1, rows_);
+        for (int k = 1; k < num_coefficients; ++k)
+        {
+          derivative.row(k - 1) = k * coefficients.row(k);
+        }
+        coefficients = std::move(derivative);
+      }
+    }
+  }
+
+  // A zero-duration spline has no non-empty span, evaluate it as the constant value at its start instead
+  if (span_starts_.empty())
+  {
+    span_starts_.push_back(start_time_);
+    span_coefficients_[0].push_back(trajectory.value(start_time_).transpose());
+    for (int derivative_order = 1; derivative_order <= kMaxDerivativeOrder; ++derivative_order)
+    {
+      span_coefficients_[derivative_order].push_back(Eigen::MatrixXd(0, rows_));
+    }
+  }
+}
+
+void BsplineSampler::sample(const std::vector<double>& times, Eigen::MatrixXd* positions, Eigen::MatrixXd* velocities,
+                            Eigen::MatrixXd* accelerations) const
+{
+  assert(std::is_sorted(times.begin(), times.end()));
+  const std::array<Eigen::MatrixXd*, kMaxDerivativeOrder + 1> outputs = { positions, velocities, accelerations };
+  for (auto* output : outputs)
+  {
+    if (output)
+    {
+      output->resize(static_cast<Eigen::Index>(times.size()), rows_);
+    }
+  }
+
+  // Group the samples by knot span, spans only ever move forward since the times are sorted
+  std::size_t span = 0;
+  std::size_t begin = 0;
+  while (begin < times.size())
+  {
+    const double time = std::clamp(times[begin], start_time_, end_time_);
+    while (span + 1 < span_starts_.size() && time >= span_starts_[span + 1])
+    {
+      ++span;
+    }
+    const double span_end =
+        span + 1 < span_starts_.size() ? span_starts_[span + 1] : std::numeric_limits<double>::infinity();
+    std::size_t end = begin + 1;
+    while (end < times.size() && std::clamp(times[end], start_time_, end_time_) < span_end)
+    {
+      ++end;
+    }
+
+    for (int derivative_order = 0; derivative_order <= kMaxDerivativeOrder; ++derivative_order)
+    {
+      if (outputs[derivative_order])
+      {
+        sampleSpan(span, times, begin, end, derivative_order, *outputs[derivative_order]);
+      }
+    }
+    begin = end;
+  }
+}
+
+void BsplineSampler::sampleSpan(std::size_t span, const std::vector<double>& times, std::size_t begin,
+                                std::size_t end, int derivative_order, Eigen::MatrixXd& output) const
+{
+  const auto& coefficients = span_coefficients_[derivative_order][span];
+  const auto num_coefficients = coefficients.rows();
+  if (num_coefficients == 0)
+  {
+    output.middleRows(begin, end - begin).setZero();
+    return;
+  }
+
+  // Horner's scheme, joint by joint so that both the coefficients and the output are accessed contiguously
+  const double span_start = span_starts_[span];
+  for (int joint = 0; joint < rows_; ++joint)
+  {
+    const double* joint_coefficients = coefficients.col(joint).data();
+    double* joint_output = output.col(joint).data();
+    for (std::size_t i = begin; i < end; ++i)
+    {
+      const double u = std::clamp(times[i], start_time_, end_time_) - span_start;
+      double value = joint_coefficients[num_coefficients - 1];
+      for (auto k = num_coefficients - 2; k >= 0; --k)
+      {
+        value = value * u + joint_coefficients[k];
+      }
+      joint_output[i] = value;
+    }
+  }
+}
+
+void sampleTrajectory(const ::drake::trajectories::Trajectory<double>& trajectory, const std::vector<double>& times,
+                      Eigen::MatrixXd& positions, Eigen::MatrixXd* velocities)
+{
+  if (const auto* bspline = dynamic_cast<const ::drake::trajectories::BsplineTrajectory<double>*>(&trajectory))
+  {
+    BsplineSampler(*bspline).sample(times, &positions, velocities);
+    return;
+  }
+
+  positions = trajectory.vector_values(times).transpose();
+  if (velocities)
+  {
+    *velocities = trajectory.MakeDerivative()->vector_values(times).transpose();
+  }
+}
+}  // namespace moveit::drake
@@ -35,6 +35,11 @@
 /* Author: Sebastian Jahr
  */
 
+#include <algorithm>
+#include <cctype>
+#include <stdexcept>
+
+#include <moveit/drake/bspline_sampler.hpp>
 #include <moveit/drake/conversions.hpp>
 
 namespace
@@ -54,137 +59,185 @@ using ::drake::multibody::MultibodyPlant;
 using ::drake::multibody::Parser;
 using ::drake::systems::DiagramBuilder;
 
-[[nodiscard]] Eigen::VectorXd getJointPositionVector(const moveit::core::RobotState& moveit_state,
-                                                     const std::string& group_name, const MultibodyPlant<double>& plant)
+JointIndexMap::JointIndexMap(const moveit::core::JointModelGroup* joint_model_group,
+                             const MultibodyPlant<double>& plant)
+  : joint_model_group_(joint_model_group)
+  , num_positions_(plant.num_positions())
+  , num_velocities_(plant.num_velocities())
 {
-  const auto& joint_model_group = moveit_state.getRobotModel()->getJointModelGroup(group_name);
-  assert(plant.num_positions() >= joint_model_group->getActiveJointModels().size());
-  Eigen::VectorXd joint_positions = Eigen::VectorXd::Zero(plant.num_positions());
+  const auto& active_joint_models = joint_model_group->getActiveJointModels();
+  assert(plant.num_positions() >= static_cast<int>(active_joint_models.size()));
+  joint_indices_.reserve(active_joint_models.size());
+  for (const auto& joint_model : active_joint_models)
+  {
+    const auto& joint = plant.GetJointByName(joint_model->getName());
+    assert(joint.num_positions() == static_cast<int>(joint_model->getVariableCount()));
+    joint_indices_.push_back(
+        { joint_model, joint_model->getFirstVariableIndex(), joint.position_start(), joint.velocity_start() });
+  }
+}
 
-  for (const auto& joint_model : joint_model_group->getActiveJointModels())
+void JointIndexMap::getPositions(const moveit::core::RobotState& moveit_state,
+                                 Eigen::Ref<Eigen::VectorXd> positions) const
+{
+  assert(positions.size() == num_positions_);
+  const double* variable_positions = moveit_state.getVariablePositions();
+  for (const auto& joint : joint_indices_)
   {
-    const auto& joint_name = joint_model->getName();
-    const auto& joint_index = plant.GetJointByName(joint_name).ordinal();
-    joint_positions(joint_index) = moveit_state.getVariablePosition(joint_name);
+    positions(joint.position_index) = variable_positions[joint.variable_index];
   }
-  return joint_positions;
 }
 
-[[nodiscard]] Eigen::VectorXd getJointVelocityVector(const moveit::core::RobotState& moveit_state,
-                                                     const std::string& group_name, const MultibodyPlant<double>& plant)
+void JointIndexMap::getVelocities(const moveit::core::RobotState& moveit_state,
+                                  Eigen::Ref<Eigen::VectorXd> velocities) const
 {
-  const auto& joint_model_group = moveit_state.getRobotModel()->getJointModelGroup(group_name);
-  assert(plant.num_velocities() >= joint_model_group->getActiveJointModels().size());
-  Eigen::VectorXd joint_velocities = Eigen::VectorXd::Zero(plant.num_velocities());
-  for (const auto& joint_model : joint_model_group->getActiveJointModels())
+  assert(velocities.size() == num_velocities_);
+  const double* variable_velocities = moveit_state.getVariableVelocities();
+  for (const auto& joint : joint_indices_)
   {
-    const auto& joint_name = joint_model->getName();
-    const auto& joint_index = plant.GetJointByName(joint_name).ordinal();
-    joint_velocities(joint_index) = moveit_state.getVariableVelocity(joint_name);
+    velocities(joint.velocity_index) = variable_velocities[joint.variable_index];
   }
-  return joint_velocities;
 }
 
-void getPositionBounds(const moveit::core::JointModelGroup* joint_model_group, const MultibodyPlant<double>& plant,
-                       Eigen::VectorXd& lower_position_bounds, Eigen::VectorXd& upper_position_bounds)
+void JointIndexMap::setPositions(const Eigen::Ref<const Eigen::VectorXd>& positions,
+                                 moveit::core::RobotState& moveit_state) const
 {
-  assert(plant.num_positions() >= joint_model_group->getActiveJointModels().size());
-  lower_position_bounds.resize(plant.num_positions());
-  upper_position_bounds.resize(plant.num_positions());
-  for (int i = 0; i < plant.num_positions(); ++i)
+  assert(positions.size() == num_positions_);
+  for (const auto& joint : joint_indices_)
   {
-    lower_position_bounds(i) = std::numeric_limits<double>::lowest();
-    upper_position_bounds(i) = std::numeric_limits<double>::max();
+    moveit_state.setJointPositions(joint.joint_model, &positions(joint.position_index));
   }
-  for (const auto& joint_model : joint_model_group->getActiveJointModels())
+}
+
+void JointIndexMap::setVelocities(const Eigen::Ref<const Eigen::VectorXd>& velocities,
+                                  moveit::core::RobotState& moveit_state) const
+{
+  assert(velocities.size() == num_velocities_);
+  for (const auto& joint : joint_indices_)
   {
-    const moveit::core::VariableBounds& bounds = joint_model->getVariableBounds()[0];  // Assume single DoF joints
-    const auto& joint_name = joint_model->getName();
-    const auto& joint_index = plant.GetJointByName(joint_name).ordinal();
+    moveit_state.setJointVelocities(joint.joint_model, &velocities(joint.velocity_index));
+  }
+}
+
+[[nodiscard]] Eigen::VectorXd getJointPositionVector(const moveit::core::RobotState& moveit_state,
+                                                     const JointIndexMap& joint_index_map)
+{
+  Eigen::VectorXd joint_positions = Eigen::VectorXd::Zero(joint_index_map.getNumPositions());
+  joint_index_map.getPositions(moveit_state, joint_positions);
+  return joint_positions;
+}
 
+[[nodiscard]] Eigen::VectorXd getJointVelocityVector(const moveit::core::RobotState& moveit_state,
+                                                     const JointIndexMap& joint_index_map)
+{
+  Eigen::VectorXd joint_velocities = Eigen::VectorXd::Zero(joint_index_map.getNumVelocities());
+  joint_index_map.getVelocities(moveit_state, joint_velocities);
+  return joint_velocities;
+}
+
+[[nodiscard]] Eigen::VectorXd getJointPositionVector(const moveit::core::RobotState& moveit_state,
+                                                     const std::string& group_name, const MultibodyPlant<double>& plant)
+{
+  return getJointPositionVector(moveit_state,
+                                JointIndexMap(moveit_state.getRobotModel()->getJointModelGroup(group_name), plant));
+}
+
+[[nodiscard]] Eigen::VectorXd getJointVelocityVector(const moveit::core::RobotState& moveit_state,
+                                                     const std::string& group_name, const MultibodyPlant<double>& plant)
+{
+  return getJointVelocityVector(moveit_state,
+                                JointIndexMap(moveit_state.getRobotModel()->getJointModelGroup(group_name), plant));
+}
+
+void getPositionBounds(const JointIndexMap& joint_index_map, Eigen::VectorXd& lower_position_bounds,
+                       Eigen::VectorXd& upper_position_bounds)
+{
+  lower_position_bounds.setConstant(joint_index_map.getNumPositions(), std::numeric_limits<double>::lowest());
+  upper_position_bounds.setConstant(joint_index_map.getNumPositions(), std::numeric_limits<double>::max());
+  for (const auto& joint : joint_index_map.getJointIndices())
+  {
+    const moveit::core::VariableBounds& bounds = joint.joint_model->getVariableBounds()[0];  // Assume single DoF joints
     if (bounds.position_bounded_)
     {
-      lower_position_bounds(joint_index) = bounds.min_position_;
-      upper_position_bounds(joint_index) = bounds.max_position_;
+      lower_position_bounds(joint.position_index) = bounds.min_position_;
+      upper_position_bounds(joint.position_index) = bounds.max_position_;
     }
   }
 }
 
-void getVelocityBounds(const moveit::core::JointModelGroup* joint_model_group, const MultibodyPlant<double>& plant,
-                       Eigen::VectorXd& lower_velocity_bounds, Eigen::VectorXd& upper_velocity_bounds)
+void getVelocityBounds(const JointIndexMap& joint_index_map, Eigen::VectorXd& lower_velocity_bounds,
+                       Eigen::VectorXd& upper_velocity_bounds)
 {
-  assert(plant.num_velocities() >= joint_model_group->getActiveJointModels().size());
-  lower_velocity_bounds.resize(plant.num_velocities());
-  upper_velocity_bounds.resize(plant.num_velocities());
-  for (int i = 0; i < plant.num_velocities(); ++i)
+  lower_velocity_bounds.setConstant(joint_index_map.getNumVelocities(), -kMaxVelocity);
+  upper_velocity_bounds.setConstant(joint_index_map.getNumVelocities(), kMaxVelocity);
+  for (const auto& joint : joint_index_map.getJointIndices())
   {
-    lower_velocity_bounds(i) = -kMaxVelocity;
-    upper_velocity_bounds(i) = kMaxVelocity;
-  }
-  for (const auto& joint_model : joint_model_group->getActiveJointModels())
-  {
-    const moveit::core::VariableBounds& bounds = joint_model->getVariableBounds()[0];  // Assume single DoF joints
-    const auto& joint_name = joint_model->getName();
-    const auto& joint_index = plant.GetJointByName(joint_name).ordinal();
-
+    const moveit::core::VariableBounds& bounds = joint.joint_model->getVariableBounds()[0];  // Assume single DoF joints
     if (bounds.velocity_bounded_)
     {
-      lower_velocity_bounds(joint_index) = bounds.min_velocity_;
-      upper_velocity_bounds(joint_index) = bounds.max_velocity_;
+      lower_velocity_bounds(joint.velocity_index) = bounds.min_velocity_;
+      upper_velocity_bounds(joint.velocity_index) = bounds.max_velocity_;
     }
   }
 }
 
-void getAccelerationBounds(const moveit::core::JointModelGroup* joint_model_group, const MultibodyPlant<double>& plant,
-                           Eigen::VectorXd& lower_acceleration_bounds, Eigen::VectorXd& upper_acceleration_bounds)
+void getAccelerationBounds(const JointIndexMap& joint_index_map, Eigen::VectorXd& lower_acceleration_bounds,
+                           Eigen::VectorXd& upper_acceleration_bounds)
 {
-  assert(plant.num_accelerations() >= joint_model_group->getActiveJointModels().size());
-  lower_acceleration_bounds.resize(plant.num_velocities());
-  upper_acceleration_bounds.resize(plant.num_velocities());
-  for (int i = 0; i < plant.num_velocities(); ++i)
+  lower_acceleration_bounds.setConstant(joint_index_map.getNumVelocities(), -kMaxAcceleration);
+  upper_acceleration_bounds.setConstant(joint_index_map.getNumVelocities(), kMaxAcceleration);
+  for (const auto& joint : joint_index_map.getJointIndices())
   {
-    lower_acceleration_bounds(i) = -kMaxAcceleration;
-    upper_acceleration_bounds(i) = kMaxAcceleration;
-  }
-  for (const auto& joint_model : joint_model_group->getActiveJointModels())
-  {
-    const moveit::core::VariableBounds& bounds = joint_model->getVariableBounds()[0];  // Assume single DoF joints
-    const auto& joint_name = joint_model->getName();
-    const auto& joint_index = plant.GetJointByName(joint_name).ordinal();
-
+    const moveit::core::VariableBounds& bounds = joint.joint_model->getVariableBounds()[0];  // Assume single DoF joints
     if (bounds.acceleration_bounded_)
     {
-      lower_acceleration_bounds(joint_index) = bounds.min_acceleration_;
-      upper_acceleration_bounds(joint_index) = bounds.max_acceleration_;
+      lower_acceleration_bounds(joint.velocity_index) = bounds.min_acceleration_;
+      upper_acceleration_bounds(joint.velocity_index) = bounds.max_acceleration_;
     }
   }
 }
 
-void getJerkBounds(const moveit::core::JointModelGroup* joint_model_group, const MultibodyPlant<double>& plant,
-                   Eigen::VectorXd& lower_jerk_bounds, Eigen::VectorXd& upper_jerk_bounds)
+void getJerkBounds(const JointIndexMap& joint_index_map, Eigen::VectorXd& lower_jerk_bounds,
+                   Eigen::VectorXd& upper_jerk_bounds)
 {
-  assert(plant.num_velocities() >= joint_model_group->getActiveJointModels().size());
-  lower_jerk_bounds.resize(plant.num_velocities());
-  upper_jerk_bounds.resize(plant.num_velocities());
-  for (int i = 0; i < plant.num_velocities(); ++i)
+  lower_jerk_bounds.setConstant(joint_index_map.getNumVelocities(), -kMaxJerk);
+  upper_jerk_bounds.setConstant(joint_index_map.getNumVelocities(), kMaxJerk);
+  for (const auto& joint : joint_index_map.getJointIndices())
   {
-    lower_jerk_bounds(i) = -kMaxJerk;
-    upper_jerk_bounds(i) = kMaxJerk;
-  }
-  for (const auto& joint_model : joint_model_group->getActiveJointModels())
-  {
-    const moveit::core::VariableBounds& bounds = joint_model->getVariableBounds()[0];  // Assume single DoF joints
-    const auto& joint_name = joint_model->getName();
-    const auto& joint_index = plant.GetJointByName(joint_name).ordinal();
-
+    const moveit::core::VariableBounds& bounds = joint.joint_model->getVariableBounds()[0];  // Assume single DoF joints
     if (bounds.jerk_bounded_)
     {
-      lower_jerk_bounds(joint_index) = bounds.min_jerk_;
-      upper_jerk_bounds(joint_index) = bounds.max_jerk_;
+      lower_jerk_bounds(joint.velocity_index) = bounds.min_jerk_;
+      upper_jerk_bounds(joint.velocity_index) = bounds.max_jerk_;
     }
   }
 }
 
+void getPositionBounds(const moveit::core::JointModelGroup* joint_model_group, const MultibodyPlant<double>& plant,
+                       Eigen::VectorXd& lower_position_bounds, Eigen::VectorXd& upper_position_bounds)
+{
+  getPositionBounds(JointIndexMap(joint_model_group, plant), lower_position_bounds, upper_position_bounds);
+}
+
+void getVelocityBounds(const moveit::core::JointModelGroup* joint_model_group, const MultibodyPlant<double>& plant,
+                       Eigen::VectorXd& lower_velocity_bounds, Eigen::VectorXd& upper_velocity_bounds)
+{
+  getVelocityBounds(JointIndexMap(joint_model_group, plant), lower_velocity_bounds, upper_velocity_bounds);
+}
+
+void getAccelerationBounds(const moveit::core::JointModelGroup* joint_model_group, const MultibodyPlant<double>& plant,
+                           Eigen::VectorXd& lower_acceleration_bounds, Eigen::VectorXd& upper_acceleration_bounds)
+{
+  getAccelerationBounds(JointIndexMap(joint_model_group, plant), lower_acceleration_bounds,
+                        upper_acceleration_bounds);
+}
+
+void getJerkBounds(const moveit::core::JointModelGroup* joint_model_group, const MultibodyPlant<double>& plant,
+                   Eigen::VectorXd& lower_jerk_bounds, Eigen::VectorXd& upper_jerk_bounds)
+{
+  getJerkBounds(JointIndexMap(joint_model_group, plant), lower_jerk_bounds, upper_jerk_bounds);
+}
+
 [[nodiscard]] ::drake::trajectories::PiecewisePolynomial<double>
 getPiecewisePolynomial(const ::robot_trajectory::RobotTrajectory& robot_trajectory,
                        const moveit::core::JointModelGroup* group, const MultibodyPlant<double>& plant)
@@ -195,10 +248,11 @@ getPiecewisePolynomial(const ::robot_trajectory::RobotTrajectory& robot_trajecto
   samples.reserve(robot_trajectory.getWayPointCount());
 
   // Create samples & breaks
+  const JointIndexMap joint_index_map(group, plant);
   for (std::size_t i = 0; i < robot_trajectory.getWayPointCount(); ++i)
   {
     const auto& state = robot_trajectory.getWayPoint(i);
-    samples.emplace_back(getJointPositionVector(state, group->getName(), plant));
+    samples.emplace_back(getJointPositionVector(state, joint_index_map));
     breaks.emplace_back(robot_trajectory.getWayPointDurationFromStart(i));
   }
 
@@ -206,59 +260,326 @@ getPiecewisePolynomial(const ::robot_trajectory::RobotTrajectory& robot_trajecto
   return ::drake::trajectories::PiecewisePolynomial<double>::FirstOrderHold(breaks, samples);
 }
 
+void getRobotTrajectory(const ::drake::trajectories::Trajectory<double>& drake_trajectory,
+                        const std::vector<double>& times, const JointIndexMap& joint_index_map,
+                        std::shared_ptr<::robot_trajectory::RobotTrajectory>& moveit_trajectory)
+{
+  // Reset output trajectory
+  moveit_trajectory->clear();
+
+  // Evaluate all samples at once, with one row per sample
+  Eigen::MatrixXd positions;
+  Eigen::MatrixXd velocities;
+  sampleTrajectory(drake_trajectory, times, positions, &velocities);
+
+  // Allocate all waypoints before filling them, so that the loop below only copies values
+  std::vector<moveit::core::RobotStatePtr> waypoints(times.size());
+  for (auto& waypoint : waypoints)
+  {
+    waypoint = std::make_shared<moveit::core::RobotState>(moveit_trajectory->getRobotModel());
+  }
+
+  double t_prev = 0.0;
+  Eigen::VectorXd position(positions.cols());
+  Eigen::VectorXd velocity(velocities.cols());
+  for (std::size_t i = 0; i < times.size(); ++i)
+  {
+    position = positions.row(i).transpose();
+    velocity = velocities.row(i).transpose();
+    joint_index_map.setPositions(position, *waypoints[i]);
+    joint_index_map.setVelocities(velocity, *waypoints[i]);
+    moveit_trajectory->addSuffixWayPoint(waypoints[i], times[i] - t_prev);
+    t_prev = times[i];
+  }
+}
+
+void getRobotTrajectory(const ::drake::trajectories::Trajectory<double>& drake_trajectory, const double delta_t,
+                        const JointIndexMap& joint_index_map,
+                        std::shared_ptr<::robot_trajectory::RobotTrajectory>& moveit_trajectory)
+{
+  getRobotTrajectory(drake_trajectory, getUniformSampleTimes(drake_trajectory, delta_t), joint_index_map,
+                     moveit_trajectory);
+}
+
 void getRobotTrajectory(const ::drake::trajectories::Trajectory<double>& drake_trajectory, const double delta_t,
                         const MultibodyPlant<double>& plant,
                         std::shared_ptr<::robot_trajectory::RobotTrajectory>& moveit_trajectory)
 {
+  getRobotTrajectory(drake_trajectory, delta_t, JointIndexMap(moveit_trajectory->getGroup(), plant),
+                     moveit_trajectory);
+}
+
+BsplineTrajectoryData
+getBsplineTrajectoryData(const ::drake::trajectories::BsplineTrajectory<double>& bspline_trajectory,
+                         const JointIndexMap& joint_index_map)
+{
+  const auto& joint_indices = joint_index_map.getJointIndices();
+  const auto& control_points = bspline_trajectory.control_points();
+  const double start_time = bspline_trajectory.start_time();
+
+  BsplineTrajectoryData bspline_data;
+  bspline_data.order = bspline_trajectory.basis().order();
+  bspline_data.duration = bspline_trajectory.end_time() - start_time;
+  bspline_data.knots.reserve(bspline_trajectory.basis().knots().size());
+  for (const double knot : bspline_trajectory.basis().knots())
+  {
+    bspline_data.knots.push_back(knot - start_time);
+  }
+
+  bspline_data.joint_names.reserve(joint_indices.size());
+  bspline_data.control_points.resize(static_cast<Eigen::Index>(joint_indices.size()),
+                                     static_cast<Eigen::Index>(control_points.size()));
+  for (std::size_t i = 0; i < joint_indices.size(); ++i)
+  {
+    bspline_data.joint_names.push_back(joint_indices[i].joint_model->getName());
+    for (std::size_t j = 0; j < control_points.size(); ++j)
+    {
+      bspline_data.control_points(i, j) = control_points[j](joint_indices[i].position_index, 0);
+    }
+  }
+  return bspline_data;
+}
+
+void getRobotTrajectory(const BsplineTrajectoryData& bspline_data, const double delta_t,
+                        std::shared_ptr<::robot_trajectory::RobotTrajectory>& moveit_trajectory)
+{
+  std::vector<Eigen::MatrixXd> control_points;
+  control_points.reserve(bspline_data.control_points.cols());
+  for (Eigen::Index j = 0; j < bspline_data.control_points.cols(); ++j)
+  {
+    control_points.emplace_back(bspline_data.control_points.col(j));
+  }
+  const ::drake::trajectories::BsplineTrajectory<double> bspline_trajectory(
+      ::drake::math::BsplineBasis<double>(bspline_data.order, bspline_data.knots), control_points);
+
+  const auto& robot_model = moveit_trajectory->getRobotModel();
+  std::vector<const moveit::core::JointModel*> joint_models;
+  joint_models.reserve(bspline_data.joint_names.size());
+  for (const auto& joint_name : bspline_data.joint_names)
+  {
+    const auto* joint_model = robot_model->getJointModel(joint_name);
+    if (!joint_model)
+    {
+      throw std::invalid_argument("Joint '" + joint_name + "' of the B-spline is not part of the robot model");
+    }
+    joint_models.push_back(joint_model);
+  }
+
   // Reset output trajectory
   moveit_trajectory->clear();
 
-  // Get the start and end times of the piecewise polynomial
-  double t_prev = 0.0;
-  const auto num_pts = static_cast<size_t>(std::ceil(drake_trajectory.end_time() / delta_t) + 1);
+  // Evaluate all samples at once, with one row per sample
+  const auto times = getUniformSampleTimes(bspline_trajectory, delta_t);
+  Eigen::MatrixXd positions;
+  Eigen::MatrixXd velocities;
+  BsplineSampler(bspline_trajectory).sample(times, &positions, &velocities);
 
-  const auto active_joints = moveit_trajectory->getGroup()->getActiveJointModels();
-  for (unsigned int i = 0; i < num_pts; ++i)
+  // The trajectory stores a copy of every waypoint, so a single state is updated for all of them
+  moveit::core::RobotState waypoint(robot_model);
+  waypoint.setToDefaultValues();
+  double t_prev = 0.0;
+  for (std::size_t i = 0; i < times.size(); ++i)
   {
-    const auto t_scale = static_cast<double>(i) / static_cast<double>(num_pts - 1);
-    const auto t = std::min(t_scale, 1.0) * drake_trajectory.end_time();
-    const auto pos_val = drake_trajectory.value(t);
-    const auto vel_val = drake_trajectory.EvalDerivative(t);
-    const auto waypoint = std::make_shared<moveit::core::RobotState>(moveit_trajectory->getRobotModel());
-    for (const auto& joint_model : active_joints)
+    for (std::size_t j = 0; j < joint_models.size(); ++j)
     {
-      const auto& joint_name = joint_model->getName();
-      const auto& joint_index = plant.GetJointByName(joint_name).ordinal();
-      waypoint->setJointPositions(joint_model, &pos_val(joint_index));
-      waypoint->setJointVelocities(joint_model, &vel_val(joint_index));
+      waypoint.setJointPositions(joint_models[j], &positions(i, j));
+      waypoint.setJointVelocities(joint_models[j], &velocities(i, j));
     }
+    moveit_trajectory->addSuffixWayPoint(waypoint, times[i] - t_prev);
+    t_prev = times[i];
+  }
+}
 
-    moveit_trajectory->addSuffixWayPoint(waypoint, t - t_prev);
-    t_prev = t;
+std::vector<double> getUniformSampleTimes(const ::drake::trajectories::Trajectory<double>& drake_trajectory,
+                                          const double delta_t)
+{
+  const auto num_pts = static_cast<size_t>(std::ceil(drake_trajectory.end_time() / delta_t) + 1);
+  std::vector<double> times(num_pts);
+  for (std::size_t i = 0; i < num_pts; ++i)
+  {
+    const auto t_scale = num_pts > 1 ? static_cast<double>(i) / static_cast<double>(num_pts - 1) : 0.0;
+    times[i] = std::min(t_scale, 1.0) * drake_trajectory.end_time();
   }
+  return times;
 }
 
-std::string replaceSTLWithOBJ(const std::string& input)
+std::vector<double> getAdaptiveSampleTimes(const ::drake::trajectories::Trajectory<double>& drake_trajectory,
+                                           const double delta_t, const double tolerance)
 {
-  std::string result = input;
-  const std::string lower_case_stl = ".stl";
-  const std::string upper_case_stl = ".STL";
-  const std::string replacement = ".obj";
+  const auto dense_times = getUniformSampleTimes(drake_trajectory, delta_t);
+  if (dense_times.size() <= 2)
+  {
+    return dense_times;
+  }
+  Eigen::MatrixXd positions;
+  sampleTrajectory(drake_trajectory, dense_times, positions);
 
-  size_t pos = 0;
-  while ((pos = result.find(lower_case_stl, pos)) != std::string::npos)
+  // Split segments at their worst sample until the linear interpolation of every segment is within tolerance
+  std::vector<bool> keep(dense_times.size(), false);
+  keep.front() = true;
+  keep.back() = true;
+  std::vector<std::pair<std::size_t, std::size_t>> segments = { { 0, dense_times.size() - 1 } };
+  while (!segments.empty())
   {
-    result.replace(pos, lower_case_stl.length(), replacement);
-    pos += replacement.length();  // Move past the replacement to avoid infinite loop
+    const auto [first, last] = segments.back();
+    segments.pop_back();
+
+    double max_error = 0.0;
+    std::size_t worst = first;
+    const double duration = dense_times[last] - dense_times[first];
+    for (std::size_t i = first + 1; i < last; ++i)
+    {
+      const double s = (dense_times[i] - dense_times[first]) / duration;
+      const double error =
+          (positions.row(i) - (1.0 - s) * positions.row(first) - s * positions.row(last)).cwiseAbs().maxCoeff();
+      if (error > max_error)
+      {
+        max_error = error;
+        worst = i;
+      }
+    }
+    if (max_error > tolerance)
+    {
+      keep[worst] = true;
+      segments.emplace_back(first, worst);
+      segments.emplace_back(worst, last);
+    }
   }
 
-  pos = 0;
-  while ((pos = result.find(upper_case_stl, pos)) != std::string::npos)
+  std::vector<double> times;
+  for (std::size_t i = 0; i < dense_times.size(); ++i)
   {
-    result.replace(pos, upper_case_stl.length(), replacement);
-    pos += replacement.length();  // Move past the replacement to avoid infinite loop
+    if (keep[i])
+    {
+      times.push_back(dense_times[i]);
+    }
   }
+  return times;
+}
+
+bool hasFileExtension(std::string_view filename, std::string_view extension)
+{
+  if (filename.size() < extension.size())
+  {
+    return false;
+  }
+  const auto suffix = filename.substr(filename.size() - extension.size());
+  return std::equal(suffix.begin(), suffix.end(), extension.begin(), [](char a, char b) {
+    return std::tolower(static_cast<unsigned char>(a)) == b;
+  });
+}
+
+std::string rewriteMeshFilenames(const std::string& input,
+                                 const std::function<std::optional<std::string>(const std::string& filename)>& rewrite)
+{
+  constexpr auto npos = std::string::npos;
+  const auto size = input.size();
+  const auto is_whitespace = [](char c) { return c == ' ' || c == '\t' || c == '\r' || c == '\n'; };
+  const auto skip_whitespace = [&](std::size_t pos) {
+    while (pos < size && is_whitespace(input[pos]))
+    {
+      ++pos;
+    }
+    return pos;
+  };
+  const auto find_name_end = [&](std::size_t pos) {
+    while (pos < size && !is_whitespace(input[pos]) && input[pos] != '=' && input[pos] != '/' && input[pos] != '>')
+    {
+      ++pos;
+    }
+    return pos;
+  };
 
+  std::string result;
+  result.reserve(size);
+  std::size_t copied = 0;  // Everything before this position has already been appended to the result
+  std::size_t pos = 0;
+  while (pos < size && (pos = input.find('<', pos)) != npos)
+  {
+    // Skip comments, CDATA sections, declarations and processing instructions
+    if (input.compare(pos, 4, "<!--") == 0)
+    {
+      pos = input.find("-->", pos);
+      continue;
+    }
+    if (input.compare(pos, 2, "<!") == 0 || input.compare(pos, 2, "<?") == 0)
+    {
+      pos = input.find('>', pos);
+      continue;
+    }
+
+    const auto name_begin = pos + 1;
+    pos = find_name_end(name_begin);
+    if (input.compare(name_begin, pos - name_begin, "mesh") != 0)
+    {
+      // Only skip to the end of other tags, quoted values may contain '>'
+      for (char quote = 0; pos < size && (quote || input[pos] != '>'); ++pos)
+      {
+        if (input[pos] == quote)
+        {
+          quote = 0;
+        }
+        else if (!quote && (input[pos] == '"' || input[pos] == '\''))
+        {
+          quote = input[pos];
+        }
+      }
+      continue;
+    }
+
+    // Walk the attributes of the mesh element up to the end of the tag
+    while ((pos = skip_whitespace(pos)) < size && input[pos] != '>')
+    {
+      if (input[pos] == '/' || input[pos] == '=')
+      {
+        ++pos;
+        continue;
+      }
+
+      const auto attribute_begin = pos;
+      const auto attribute_end = find_name_end(pos);
+      pos = skip_whitespace(attribute_end);
+      if (pos == size || input[pos] != '=')
+      {
+        continue;
+      }
+      pos = skip_whitespace(pos + 1);
+      if (pos == size || (input[pos] != '"' && input[pos] != '\''))
+      {
+        continue;
+      }
+      const auto value_begin = pos + 1;
+      const auto value_end = input.find(input[pos], value_begin);
+      if (value_end == npos)
+      {
+        pos = size;
+        break;
+      }
+      pos = value_end + 1;
+
+      if (input.compare(attribute_begin, attribute_end - attribute_begin, "filename") == 0)
+      {
+        if (auto replacement = rewrite(input.substr(value_begin, value_end - value_begin)))
+        {
+          result.append(input, copied, value_begin - copied);
+          result += *replacement;
+          copied = value_end;
+        }
+      }
+    }
+  }
+  result.append(input, copied, npos);
   return result;
 }
+
+std::string replaceSTLWithOBJ(const std::string& input)
+{
+  return rewriteMeshFilenames(input, [](const std::string& filename) -> std::optional<std::string> {
+    if (!hasFileExtension(filename, ".stl"))
+    {
+      return std::nullopt;
+    }
+    return filename.substr(0, filename.size() - 4) + ".obj";
+  });
+}
 }  // namespace moveit::drake
@@ -0,0 +1,183 @@
+#include <exception>
+#include <filesystem>
+
+#include <drake/multibody/parsing/parser.h>
+#include <drake/systems/framework/diagram_builder.h>
+
+#include <moveit/drake/mesh_conversion.hpp>
+#include <moveit/utils/logger.hpp>
+
+#include <ktopt_interface/drake_model_cache.hpp>
+
+namespace ktopt_interface
+{
+namespace
+{
+/// @brief Helper function that returns the logger instance associated with the model cache.
+/// @return The logger instance.
+rclcpp::Logger getLogger()
+{
+  return moveit::getLogger("moveit.planners.ktopt_interface.model_cache");
+}
+
+/// @brief Name of the geometry source that owns all planning scene geometry.
+constexpr auto kPlanningSceneSourceName = "moveit_planning_scene";
+}  // namespace
+
+std::string makeModelParamsKey(const ktopt_interface::Params& params)
+{
+  std::string key = params.base_frame + '\n' + (params.meshcat_visualise ? "meshcat\n" : "\n") +
+                    params.mesh_cache_directory + '\n';
+  for (const auto& path : params.external_robot_description)
+  {
+    key += path + '\n';
+  }
+  return key;
+}
+
+DrakeModel::~DrakeModel()
+{
+  if (visualization_worker && diagram)
+  {
+    // The visualizer systems share the Meshcat instance, so the diagram is destroyed on the worker thread
+    visualization_worker->post([diagram = std::shared_ptr<drake::systems::Diagram<double>>(std::move(diagram))] {});
+  }
+}
+
+std::shared_ptr<const DrakeModel> buildDrakeModel(const std::string& robot_description,
+                                                  const ktopt_interface::Params& params,
+                                                  const drake::multibody::PackageMap& package_map)
+{
+  auto model = std::make_shared<DrakeModel>();
+  auto builder = std::make_unique<drake::systems::DiagramBuilder<double>>();
+
+  auto [plant, scene_graph] = drake::multibody::AddMultibodyPlantSceneGraph(builder.get(), 0.0);
+
+  auto robot_instance = drake::multibody::Parser(&plant, &scene_graph);
+
+  // AddMap() throws on packages the parser already knows under a different path, those keep Drake's path instead
+  auto& parser_package_map = robot_instance.package_map();
+  for (const auto& package_name : package_map.GetPackageNames())
+  {
+    const auto& package_path = package_map.GetPath(package_name);
+    if (!parser_package_map.Contains(package_name))
+    {
+      parser_package_map.Add(package_name, package_path);
+    }
+    else if (parser_package_map.GetPath(package_name) != package_path)
+    {
+      RCLCPP_WARN(getLogger(), "Ignoring package '%s' at '%s', it is already known at '%s'", package_name.c_str(),
+                  package_path.c_str(), parser_package_map.GetPath(package_name).c_str());
+    }
+  }
+
+  // Drake cannot handle stl files, so we convert them to obj files in the mesh cache
+  const auto mesh_cache_directory = params.mesh_cache_directory.empty() ?
+                                        moveit::drake::getDefaultMeshCacheDirectory() :
+                                        std::filesystem::path(params.mesh_cache_directory);
+  const auto description_with_obj =
+      moveit::drake::convertSTLMeshesToOBJ(robot_description, robot_instance.package_map(), mesh_cache_directory);
+
+  robot_instance.AddModelsFromString(description_with_obj, ".urdf");
+
+  if (!params.base_frame.empty())
+    plant.WeldFrames(plant.world_frame(), plant.GetFrameByName(params.base_frame));
+
+  // Planning scene objects are registered per context under this source
+  model->planning_scene_source_id = scene_graph.RegisterSource(kPlanningSceneSourceName);
+
+  plant.Finalize();
+
+  // Visualization is opt-in, headless deployments neither start a Meshcat server nor pay for visualizer systems
+  if (params.meshcat_visualise)
+  {
+    model->visualization_worker = std::make_unique<VisualizationWorker>();
+    const auto meshcat = model->visualization_worker->getMeshcat();
+
+    // A single illustration visualizer, ApplyVisualizationConfig would register further ones on the same Meshcat
+    drake::geometry::MeshcatVisualizerParams meshcat_viz_params;
+    model->visualizer = &drake::geometry::MeshcatVisualizer<double>::AddToBuilder(
+        builder.get(), scene_graph, meshcat, std::move(meshcat_viz_params));
+  }
+
+  model->plant = &plant;
+  model->scene_graph = &scene_graph;
+  model->diagram = builder->Build();
+  return model;
+}
+
+std::shared_ptr<const DrakeModel> DrakeModelCache::getModel(const std::string& robot_description,
+                                                            const ktopt_interface::Params& params)
+{
+  const auto params_key = makeModelParamsKey(params);
+
+  // Concurrent requests for the same model wait for a single build, requests for other models are not blocked by it
+  std::promise<std::shared_ptr<const DrakeModel>> promise;
+  std::shared_future<std::shared_ptr<const DrakeModel>> model;
+  bool build = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& cached_model = models_[robot_description][params_key];
+    if (!cached_model.valid())
+    {
+      cached_model = promise.get_future().share();
+      build = true;
+    }
+    model = cached_model;
+  }
+  if (!build)
+  {
+    return model.get();
+  }
+
+  try
+  {
+    RCLCPP_INFO(getLogger(), "Building Drake model for robot description ...");
+    promise.set_value(buildDrakeModel(robot_description, params, *getPackageMap(params.external_robot_description)));
+  }
+  catch (...)
+  {
+    // Waiting requests see the error, later requests try again
+    promise.set_exception(std::current_exception());
+    std::lock_guard<std::mutex> lock(mutex_);
+    const auto it = models_.find(robot_description);
+    if (it != models_.end())
+    {
+      it->second.erase(params_key);
+      if (it->second.empty())
+      {
+        models_.erase(it);
+      }
+    }
+  }
+  return model.get();
+}
+
+std::shared_ptr<const drake::multibody::PackageMap>
+DrakeModelCache::getPackageMap(const std::vector<std::string>& package_folders)
+{
+  std::lock_guard<std::mutex> lock(package_map_mutex_);
+  if (!package_map_ || package_folders != package_folders_)
+  {
+    RCLCPP_INFO(getLogger(), "Searching %zu folder(s) for packages ...", package_folders.size());
+    auto package_map = std::make_shared<drake::multibody::PackageMap>(drake::multibody::PackageMap::MakeEmpty());
+    for (const auto& path : package_folders)
+      package_map->PopulateFromFolder(path);
+    package_map_ = std::move(package_map);
+    package_folders_ = package_folders;
+  }
+  return package_map_;
+}
+
+void DrakeModelCache::evict(const std::string& robot_description)
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  models_.erase(robot_description);
+}
+
+void DrakeModelCache::clear()
+{
+  std::lock_guard<std::mutex> lock(mutex_);
+  models_.clear();
+}
+}  // namespace ktopt_interface
@@ -1,4 +1,11 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <moveit/kinematic_constraints/utils.hpp>
 #include <moveit/planning_interface/planning_interface.hpp>
 #include <moveit/planning_interface/planning_response.hpp>
 #include <moveit/planning_scene/planning_scene.hpp>
@@ -7,7 +14,10 @@
 #include <rclcpp/node.hpp>
 #include <rclcpp/logging.hpp>
 #include <std_msgs/msg/string.hpp>
+#include <ktopt_interface/drake_model_cache.hpp>
 #include <ktopt_interface/ktopt_planning_context.hpp>
+#include <ktopt_interface/ktopt_planning_context_pool.hpp>
+#include <ktopt_interface/thread_pool.hpp>
 
 namespace ktopt_interface
 {
@@ -17,6 +27,9 @@ rclcpp::Logger getLogger()
   return moveit::getLogger("moveit.planners.ktopt.planner_manager");
 }
 
+/// @brief Minimum time in milliseconds between two log messages with the planning scene cache statistics.
+constexpr int kSceneCacheStatisticsPeriodMs = 60000;
+
 /**
  * @brief Implementation for the Drake Kinematic Trajectory Optimization (KTOpt) motion planner in MoveIt.
  */
@@ -24,7 +37,22 @@ class KTOptPlannerManager : public planning_interface::PlannerManager
 {
 public:
   KTOptPlannerManager() = default;
-  ~KTOptPlannerManager() override = default;
+  ~KTOptPlannerManager() override
+  {
+    {
+      std::lock_guard<std::mutex> lock(model_mutex_);
+      shutting_down_ = true;
+      if (warm_up_context_)
+      {
+        warm_up_context_->terminate();
+      }
+    }
+    model_condition_.notify_all();
+    if (model_thread_.joinable())
+    {
+      model_thread_.join();
+    }
+  }
 
   bool initialize(const moveit::core::RobotModelConstPtr& model, const rclcpp::Node::SharedPtr& node,
                   const std::string& parameter_namespace) override
@@ -32,26 +60,37 @@ public:
     robot_model_ = model;
     node_ = node;
     param_listener_ = std::make_shared<ktopt_interface::ParamListener>(node, parameter_namespace);
+    context_pool_ = std::make_shared<KTOptPlanningContextPool>(
+        static_cast<std::size_t>(param_listener_->get_params().planning_context_pool_size));
+    thread_pool_ =
+        std::make_shared<ThreadPool>(static_cast<std::size_t>(param_listener_->get_params().num_planning_threads));
+
+    // Search the external package folders once, requests only search them again if the parameter changes
+    (void)model_cache_.getPackageMap(param_listener_->get_params().external_robot_description);
+
+    model_thread_ = std::thread([this] { processRobotDescriptions(); });
 
     // set QoS to transient local to get messages that have already been published
     // (if robot state publisher starts before planner)
     robot_description_subscriber_ = node_->create_subscription<std_msgs::msg::String>(
-        "robot_description", rclcpp::QoS(1).transient_local(), [this](const std_msgs::msg::String::SharedPtr msg) {
-          if (robot_description_.empty())
-          {
-            robot_description_ = msg->data;
-            RCLCPP_INFO(getLogger(), "Robot description set");
-          }
-        });
+        "robot_description", rclcpp::QoS(1).transient_local(),
+        [this](const std_msgs::msg::String::SharedPtr msg) { setRobotDescription(msg->data); });
     RCLCPP_INFO(getLogger(), "KTOpt planner manager initialized!");
     return true;
   }
 
   bool canServiceRequest(const planning_interface::MotionPlanRequest& req) const override
   {
-    if (robot_description_.empty())
+    if (!getRobotDescription())
     {
-      RCLCPP_ERROR(getLogger(), "Robot description is empty, do you have a robot state publisher running?");
+      if (description_received_)
+      {
+        RCLCPP_ERROR(getLogger(), "Drake model is still being loaded, try again later");
+      }
+      else
+      {
+        RCLCPP_ERROR(getLogger(), "Robot description is empty, do you have a robot state publisher running?");
+      }
       return false;
     }
     if (req.goal_constraints.empty())
@@ -91,26 +130,264 @@ public:
       return nullptr;
     }
 
+    // Plans keep the model they started with, even if a new model is swapped in meanwhile
     const auto params = param_listener_->get_params();
-    std::shared_ptr<KTOptPlanningContext> planning_context =
-        std::make_shared<KTOptPlanningContext>("KTOPT", req.group_name, params);
-    // set robot description
+    context_pool_->setMaxSize(static_cast<std::size_t>(params.planning_context_pool_size));
+    const auto model = getDrakeModel(params);
+    std::shared_ptr<KTOptPlanningContext> planning_context = context_pool_->acquire(req.group_name, params, model);
+    // set the shared robot model, built once per robot description
     planning_context->setPlanningScene(planning_scene);
-    planning_context->setRobotDescription(robot_description_);
+    planning_context->setThreadPool(thread_pool_);
+    planning_context->setDrakeModel(model);
     planning_context->setMotionPlanRequest(req);
 
+    const auto scene_cache_statistics = KTOptPlanningContext::getSceneCacheStatistics();
+    RCLCPP_INFO_THROTTLE(getLogger(), *node_->get_clock(), kSceneCacheStatisticsPeriodMs,
+                         "Planning scene cache hits: %zu, misses: %zu", scene_cache_statistics.hits,
+                         scene_cache_statistics.misses);
+
     return planning_context;
   }
 
 private:
+  /**
+   * @brief Returns the robot description new plans use.
+   * @return The URDF string, or nullptr if no model is available yet.
+   */
+  std::shared_ptr<const std::string> getRobotDescription() const
+  {
+    std::lock_guard<std::mutex> lock(model_mutex_);
+    return robot_description_;
+  }
+
+  /**
+   * @brief Returns the model new plans use.
+   * @details The published model is copied as is. It is only built here on the first request after a description that
+   * was not preloaded, or if a parameter the model depends on has changed.
+   * @param params The ROS parameters for this planner.
+   * @return The model of the current robot description.
+   */
+  std::shared_ptr<const DrakeModel> getDrakeModel(const Params& params) const
+  {
+    const auto params_key = makeModelParamsKey(params);
+    std::shared_ptr<const std::string> robot_description;
+    {
+      std::lock_guard<std::mutex> lock(model_mutex_);
+      if (model_ && model_params_key_ == params_key)
+      {
+        return model_;
+      }
+      robot_description = robot_description_;
+    }
+
+    const auto model = model_cache_.getModel(*robot_description, params);
+
+    // The replaced model is released after unlocking
+    std::shared_ptr<const DrakeModel> previous_model;
+    {
+      std::lock_guard<std::mutex> lock(model_mutex_);
+      if (robot_description_ != robot_description)
+      {
+        // The model thread swapped in a new description meanwhile, this plan still uses the outdated model but the
+        // cache must not keep it
+        model_cache_.evict(*robot_description);
+        return model;
+      }
+      if (model_ == model)
+      {
+        return model;
+      }
+      previous_model = std::exchange(model_, model);
+      model_params_key_ = params_key;
+    }
+    context_pool_->dropIdleContexts(model);
+    return model;
+  }
+
+  /**
+   * @brief Handles a robot description received from the robot_description topic.
+   * @details Without preloading, the first description is used right away and its model is built by the first
+   * request. Any other description is handed to the model thread, which swaps it in once its model is built.
+   * @param robot_description The URDF string containing the robot description.
+   */
+  void setRobotDescription(const std::string& robot_description)
+  {
+    {
+      std::lock_guard<std::mutex> lock(model_mutex_);
+      if ((robot_description_ && *robot_description_ == robot_description) ||
+          (pending_robot_description_ && *pending_robot_description_ == robot_description))
+      {
+        return;
+      }
+      description_received_ = true;
+      if (!robot_description_ && !param_listener_->get_params().preload_model)
+      {
+        robot_description_ = std::make_shared<const std::string>(robot_description);
+        RCLCPP_INFO(getLogger(), "Robot description set");
+        return;
+      }
+      pending_robot_description_ = std::make_shared<const std::string>(robot_description);
+    }
+    RCLCPP_INFO(getLogger(), "Robot description received, building its Drake model in the background");
+    model_condition_.notify_one();
+  }
+
+  /**
+   * @brief Builds the models of received robot descriptions and swaps them in, runs in the model thread.
+   * @details Only the latest pending description is built. Its model is published together with the description, so
+   * requests never build an outdated model. Plans that already hold the previous model finish with it, new plans get
+   * the new model once it is built and never wait for the build. If the build fails, the previous model stays in use.
+   */
+  void processRobotDescriptions()
+  {
+    std::unique_lock<std::mutex> lock(model_mutex_);
+    while (true)
+    {
+      model_condition_.wait(lock, [this] { return shutting_down_ || pending_robot_description_; });
+      if (shutting_down_)
+      {
+        return;
+      }
+      const auto robot_description = std::move(pending_robot_description_);
+      pending_robot_description_.reset();
+      lock.unlock();
+
+      const auto params = param_listener_->get_params();
+      const auto model = buildModel(*robot_description, params);
+
+      lock.lock();
+      // The first description is used even if its build failed, so that requests report the error
+      std::shared_ptr<const DrakeModel> previous_model;
+      if (model || !robot_description_)
+      {
+        const auto previous_robot_description = std::exchange(robot_description_, robot_description);
+        previous_model = std::exchange(model_, model);
+        model_params_key_ = makeModelParamsKey(params);
+        if (previous_robot_description)
+        {
+          RCLCPP_INFO(getLogger(), "Swapped in Drake model of new robot description");
+          model_cache_.evict(*previous_robot_description);
+        }
+        else
+        {
+          RCLCPP_INFO(getLogger(), "Robot description set");
+        }
+      }
+      if (previous_model)
+      {
+        // Idle contexts and the model of the replaced description are released outside the lock
+        lock.unlock();
+        context_pool_->dropIdleContexts(model);
+        previous_model.reset();
+        lock.lock();
+      }
+    }
+  }
+
+  /**
+   * @brief Builds the Drake model for a robot description and optionally runs a warm-up solve with it.
+   * @param robot_description The URDF string containing the robot description.
+   * @param params The ROS parameters for this planner.
+   * @return The model, or nullptr if the build failed.
+   */
+  std::shared_ptr<const DrakeModel> buildModel(const std::string& robot_description, const Params& params)
+  {
+    try
+    {
+      const auto start_time = std::chrono::steady_clock::now();
+      const auto model = model_cache_.getModel(robot_description, params);
+      RCLCPP_INFO(getLogger(), "Built Drake model in %.3f s",
+                  std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count());
+      if (!params.warm_up_group.empty())
+      {
+        warmUp(params.warm_up_group, model, params);
+      }
+      return model;
+    }
+    catch (const std::exception& e)
+    {
+      RCLCPP_ERROR(getLogger(), "Failed to build Drake model: %s", e.what());
+      return nullptr;
+    }
+  }
+
+  /**
+   * @brief Solves a request from the default state to itself, so that the first real request does not pay for loading
+   * the solver and setting up a planning context.
+   * @param group_name The joint group to plan for.
+   * @param model The newly built Drake model.
+   * @param params The ROS parameters for this planner.
+   */
+  void warmUp(const std::string& group_name, const std::shared_ptr<const DrakeModel>& model, const Params& params)
+  {
+    if (!robot_model_->hasJointModelGroup(group_name))
+    {
+      RCLCPP_WARN(getLogger(), "Skipping warm-up solve, invalid joint group '%s'", group_name.c_str());
+      return;
+    }
+
+    const auto planning_scene = std::make_shared<planning_scene::PlanningScene>(robot_model_);
+    moveit::core::RobotState goal_state(robot_model_);
+    goal_state.setToDefaultValues();
+    planning_interface::MotionPlanRequest req;
+    req.group_name = group_name;
+    req.allowed_planning_time = 10.0;
+    req.goal_constraints.push_back(
+        kinematic_constraints::constructGoalConstraints(goal_state, robot_model_->getJointModelGroup(group_name)));
+
+    // The context goes back to the pool afterwards, ready for the first request on this group
+    std::shared_ptr<KTOptPlanningContext> planning_context = context_pool_->acquire(group_name, params, model);
+    planning_context->setPlanningScene(planning_scene);
+    planning_context->setThreadPool(thread_pool_);
+    planning_context->setDrakeModel(model);
+    planning_context->setMotionPlanRequest(req);
+    {
+      std::lock_guard<std::mutex> lock(model_mutex_);
+      if (shutting_down_)
+      {
+        return;
+      }
+      warm_up_context_ = planning_context;
+    }
+
+    const auto start_time = std::chrono::steady_clock::now();
+    planning_interface::MotionPlanResponse res;
+    planning_context->solve(res);
+    RCLCPP_INFO(getLogger(), "Warm-up solve for group '%s' finished in %.3f s with error code %d", group_name.c_str(),
+                std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count(),
+                res.error_code.val);
+
+    std::lock_guard<std::mutex> lock(model_mutex_);
+    warm_up_context_.reset();
+  }
+
   moveit::core::RobotModelConstPtr robot_model_;
   rclcpp::Node::SharedPtr node_;
   std::shared_ptr<ktopt_interface::ParamListener> param_listener_;
 
   // robot description related variables
   rclcpp::Subscription<std_msgs::msg::String>::SharedPtr robot_description_subscriber_;
-  bool description_set_;
-  std::string robot_description_;
+  std::atomic<bool> description_received_{ false };
+
+  // Background model builds, guarded by model_mutex_. Models are swapped as a whole, plans keep their copy.
+  mutable std::mutex model_mutex_;
+  std::condition_variable model_condition_;
+  std::thread model_thread_;
+  bool shutting_down_ = false;
+  std::shared_ptr<const std::string> robot_description_;
+  std::shared_ptr<const std::string> pending_robot_description_;
+  mutable std::shared_ptr<const DrakeModel> model_;
+  mutable std::string model_params_key_;
+  std::shared_ptr<KTOptPlanningContext> warm_up_context_;
+
+  // Drake models shared by all planning contexts
+  mutable DrakeModelCache model_cache_;
+
+  // Reusable planning contexts
+  std::shared_ptr<KTOptPlanningContextPool> context_pool_;
+
+  // Worker threads shared by all planning contexts
+  std::shared_ptr<ThreadPool> thread_pool_;
 };
 
 }  // namespace ktopt_interface
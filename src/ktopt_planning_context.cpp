@@ -1,23 +1,46 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <filesystem>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <stdexcept>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
-#include <drake/geometry/meshcat_params.h>
+#include <drake/geometry/collision_filter_declaration.h>
 #include <drake/geometry/geometry_frame.h>
 #include <drake/geometry/geometry_instance.h>
 #include <drake/geometry/geometry_roles.h>
+#include <drake/geometry/geometry_set.h>
 #include <drake/geometry/proximity_properties.h>
+#include <drake/geometry/query_object.h>
+#include <drake/geometry/shape_specification.h>
 #include <drake/multibody/inverse_kinematics/minimum_distance_lower_bound_constraint.h>
 #include <drake/multibody/inverse_kinematics/orientation_constraint.h>
 #include <drake/multibody/inverse_kinematics/position_constraint.h>
+#include <drake/math/bspline_basis.h>
 #include <drake/math/rigid_transform.h>
 #include <drake/math/rotation_matrix.h>
-#include <drake/solvers/solve.h>
-#include <drake/visualization/visualization_config.h>
-#include <drake/visualization/visualization_config_functions.h>
+#include <drake/solvers/choose_best_solver.h>
+#include <drake/solvers/ipopt_solver.h>
+#include <drake/solvers/nlopt_solver.h>
+#include <drake/solvers/snopt_solver.h>
+#include <drake/solvers/solver_options.h>
 
 #include <moveit/constraint_samplers/constraint_sampler_manager.hpp>
+#include <moveit/drake/bspline_sampler.hpp>
 #include <moveit/drake/conversions.hpp>
+#include <moveit/drake/mesh_conversion.hpp>
 #include <moveit/planning_interface/planning_interface.hpp>
 #include <moveit/planning_scene/planning_scene.hpp>
 #include <moveit/robot_state/conversions.hpp>
@@ -37,6 +60,378 @@ rclcpp::Logger getLogger()
 
 /// @brief The namespace corresponding to the octomap in the planning scene.
 constexpr auto kOctomapNamespace = "<octomap>";
+
+/// @brief Number of planning scene transcriptions skipped because the scene was unchanged.
+std::atomic<std::size_t> scene_cache_hits{ 0 };
+
+/// @brief Number of planning scene transcriptions that had to update the scene graph context.
+std::atomic<std::size_t> scene_cache_misses{ 0 };
+
+/// @brief Guards bspline_trajectory_callback.
+std::mutex bspline_trajectory_callback_mutex;
+
+/// @brief The callback set by KTOptPlanningContext::setBsplineTrajectoryCallback(), if any.
+std::shared_ptr<const BsplineTrajectoryCallback> bspline_trajectory_callback;
+
+/// @brief Thrown from solver callbacks to abort a solve that has been terminated or ran out of time.
+class SolveCancelledError : public std::runtime_error
+{
+public:
+  SolveCancelledError() : std::runtime_error("KTOpt solve cancelled")
+  {
+  }
+};
+
+/**
+ * @brief Sets the initial guess of a multi-start attempt.
+ * @details Start 0 keeps the solver's default initial guess, start 1 uses the straight line from start to goal and
+ * later starts randomly perturb the interior control points of that line.
+ */
+void setMultiStartInitialGuess(KinematicTrajectoryOptimization& trajopt, const Eigen::VectorXd& start_position,
+                               const Eigen::VectorXd& goal_position, const double duration, const double perturbation,
+                               const std::size_t start_index)
+{
+  if (start_index == 0)
+  {
+    return;
+  }
+
+  // Seed the generator with the start index to make the attempts reproducible
+  std::mt19937 generator(static_cast<std::mt19937::result_type>(start_index));
+  std::normal_distribution<double> noise(0.0, perturbation);
+  const int num_control_points = trajopt.num_control_points();
+  std::vector<Eigen::MatrixXd> control_points;
+  control_points.reserve(num_control_points);
+  for (int i = 0; i < num_control_points; ++i)
+  {
+    const double s = num_control_points > 1 ? static_cast<double>(i) / (num_control_points - 1) : 0.0;
+    Eigen::VectorXd control_point = (1.0 - s) * start_position + s * goal_position;
+    if (start_index > 1 && i > 0 && i < num_control_points - 1)
+    {
+      for (Eigen::Index j = 0; j < control_point.size(); ++j)
+        control_point(j) += noise(generator);
+    }
+    control_points.emplace_back(std::move(control_point));
+  }
+  trajopt.SetInitialGuess(drake::trajectories::BsplineTrajectory<double>(
+      drake::math::BsplineBasis<double>(trajopt.basis().order(), num_control_points,
+                                        drake::math::KnotVectorType::kClampedUniform, 0.0, duration),
+      control_points));
+}
+
+/**
+ * @brief Returns evenly spaced path parameters.
+ * @param num_points The number of path parameters, at least two.
+ * @return The path parameters from 0 to 1.
+ */
+std::vector<double> getEvenlySpacedPathParameters(const int64_t num_points)
+{
+  std::vector<double> path_parameters(num_points);
+  for (int64_t i = 0; i < num_points; ++i)
+  {
+    path_parameters[i] = static_cast<double>(i) / (num_points - 1);
+  }
+  return path_parameters;
+}
+
+/**
+ * @brief Finds the path parameters at which a trajectory violates a collision constraint.
+ * @details The trajectory is checked at evenly spaced path parameters, of every contiguous run of violating samples
+ * the one with the largest violation is returned.
+ * @param trajectory The trajectory to verify.
+ * @param collision_constraint The collision constraint, evaluated on the joint positions.
+ * @param num_points The number of path parameters to check.
+ * @param tolerance The constraint violation up to which a sample is valid, see getFeasibilityTolerance().
+ * @return The path parameters in [0, 1] at which to add collision constraints, empty if the trajectory is valid.
+ */
+std::vector<double> findCollisionViolations(const drake::trajectories::Trajectory<double>& trajectory,
+                                            const drake::solvers::Constraint& collision_constraint,
+                                            const int num_points, const double tolerance)
+{
+  std::vector<double> times(num_points);
+  for (int i = 0; i < num_points; ++i)
+  {
+    times[i] = trajectory.start_time() + (trajectory.end_time() - trajectory.start_time()) * i / (num_points - 1);
+  }
+  Eigen::MatrixXd positions;
+  moveit::drake::sampleTrajectory(trajectory, times, positions);
+
+  std::vector<double> violations;
+  std::optional<std::pair<double, double>> worst_in_run;  // path parameter and violation
+  Eigen::VectorXd value(collision_constraint.num_constraints());
+  for (int i = 0; i < num_points; ++i)
+  {
+    collision_constraint.Eval(positions.row(i).transpose(), &value);
+    const double violation = std::max((value - collision_constraint.upper_bound()).maxCoeff(),
+                                      (collision_constraint.lower_bound() - value).maxCoeff());
+    if (violation > tolerance)
+    {
+      const double s = static_cast<double>(i) / (num_points - 1);
+      if (!worst_in_run || violation > worst_in_run->second)
+        worst_in_run = std::make_pair(s, violation);
+    }
+    else if (worst_in_run)
+    {
+      violations.push_back(worst_in_run->first);
+      worst_in_run.reset();
+    }
+  }
+  if (worst_in_run)
+    violations.push_back(worst_in_run->first);
+  return violations;
+}
+
+/**
+ * @brief Approximates the joint space path length of a trajectory.
+ * @param trajectory The trajectory to measure.
+ * @return The summed joint space distance between evenly spaced samples.
+ */
+double getPathLength(const drake::trajectories::Trajectory<double>& trajectory)
+{
+  constexpr int kNumSamples = 100;
+  std::vector<double> times(kNumSamples + 1);
+  for (int i = 0; i <= kNumSamples; ++i)
+  {
+    times[i] = trajectory.start_time() + (trajectory.end_time() - trajectory.start_time()) * i / kNumSamples;
+  }
+  Eigen::MatrixXd positions;
+  moveit::drake::sampleTrajectory(trajectory, times, positions);
+
+  double path_length = 0.0;
+  for (int i = 1; i <= kNumSamples; ++i)
+  {
+    path_length += (positions.row(i) - positions.row(i - 1)).norm();
+  }
+  return path_length;
+}
+
+/**
+ * @brief Creates the solver for a solve stage.
+ * @details Falls back to the solver Drake would choose for the nonlinear planning problems if the requested one is
+ * not available in this Drake build.
+ * @param solver_name The solver to use, one of "auto", "snopt", "ipopt" or "nlopt".
+ * @return The solver, or nullptr if no nonlinear solver is available.
+ */
+std::unique_ptr<drake::solvers::SolverInterface> makeSolver(const std::string& solver_name)
+{
+  std::optional<drake::solvers::SolverId> solver_id;
+  if (solver_name == "snopt")
+    solver_id = drake::solvers::SnoptSolver::id();
+  else if (solver_name == "ipopt")
+    solver_id = drake::solvers::IpoptSolver::id();
+  else if (solver_name == "nlopt")
+    solver_id = drake::solvers::NloptSolver::id();
+  if (solver_id)
+  {
+    auto solver = drake::solvers::MakeSolver(*solver_id);
+    if (solver->available() && solver->enabled())
+    {
+      return solver;
+    }
+    RCLCPP_WARN(getLogger(), "Solver '%s' is not available, letting Drake choose the solver.", solver_name.c_str());
+  }
+
+  // Same order of preference as ChooseBestSolver() for nonlinear programs
+  for (const auto& fallback_id :
+       { drake::solvers::SnoptSolver::id(), drake::solvers::IpoptSolver::id(), drake::solvers::NloptSolver::id() })
+  {
+    auto solver = drake::solvers::MakeSolver(fallback_id);
+    if (solver->available() && solver->enabled())
+    {
+      return solver;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * @brief Returns the constraint violation a solver accepts as feasible.
+ * @details Verifying a solution more strictly than the solver solved it would flag every sample at the constraint
+ * bound as a violation.
+ * @param solver The solver.
+ * @param feasibility_tolerance The configured feasibility tolerance, zero for the solver's default.
+ * @return The feasibility tolerance.
+ */
+double getFeasibilityTolerance(const drake::solvers::SolverInterface& solver, const double feasibility_tolerance)
+{
+  if (feasibility_tolerance > 0.0)
+    return feasibility_tolerance;
+  // IPOPT's default constr_viol_tol, SNOPT's Major feasibility tolerance and NLopt's constraint tolerance in Drake
+  if (solver.solver_id() == drake::solvers::IpoptSolver::id())
+    return 1e-4;
+  return 1e-6;
+}
+
+/// @brief Mixes the hash of a value into a running hash.
+template <typename T>
+void hashCombine(std::size_t& seed, const T& value)
+{
+  seed ^= std::hash<T>{}(value) + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2);
+}
+
+/// @brief Mixes the content of a pose into a running hash.
+void hashPose(std::size_t& seed, const Eigen::Isometry3d& pose)
+{
+  const Eigen::Vector3d translation = pose.translation();
+  const Eigen::Matrix3d linear = pose.linear();
+  for (Eigen::Index i = 0; i < 3; ++i)
+    hashCombine(seed, translation(i));
+  for (Eigen::Index i = 0; i < 9; ++i)
+    hashCombine(seed, linear.data()[i]);
+}
+
+/// @brief Content hash of a mesh, remembered for as long as the mesh is alive.
+struct MeshHash
+{
+  std::weak_ptr<const shapes::Shape> mesh;
+  std::size_t hash;
+};
+
+/// @brief Protects mesh_hashes.
+std::mutex mesh_hashes_mutex;
+
+/// @brief Content hashes of recently seen meshes by address, so that unchanged meshes are only hashed once.
+std::unordered_map<const shapes::Shape*, MeshHash> mesh_hashes;
+
+/// @brief Returns the content hash of a mesh, computing it only the first time the mesh is seen.
+std::size_t getMeshHash(const shapes::ShapeConstPtr& shape)
+{
+  {
+    std::lock_guard<std::mutex> lock(mesh_hashes_mutex);
+    const auto it = mesh_hashes.find(shape.get());
+    // An expired entry may belong to a different mesh that was allocated at the same address before
+    if (it != mesh_hashes.end() && it->second.mesh.lock() == shape)
+    {
+      return it->second.hash;
+    }
+  }
+
+  const auto& mesh = static_cast<const shapes::Mesh&>(*shape);
+  std::size_t hash = 0;
+  hashCombine(hash, mesh.vertex_count);
+  hashCombine(hash, mesh.triangle_count);
+  for (unsigned int i = 0; i < 3 * mesh.vertex_count; ++i)
+    hashCombine(hash, mesh.vertices[i]);
+  for (unsigned int i = 0; i < 3 * mesh.triangle_count; ++i)
+    hashCombine(hash, mesh.triangles[i]);
+
+  std::lock_guard<std::mutex> lock(mesh_hashes_mutex);
+  // Drop entries of destroyed meshes before the map grows
+  if (mesh_hashes.size() >= 2 * mesh_hashes.bucket_count())
+  {
+    for (auto it = mesh_hashes.begin(); it != mesh_hashes.end();)
+      it = it->second.mesh.expired() ? mesh_hashes.erase(it) : std::next(it);
+  }
+  mesh_hashes[shape.get()] = MeshHash{ shape, hash };
+  return hash;
+}
+
+/// @brief Mixes the content of a MoveIt shape into a running hash.
+void hashShape(std::size_t& seed, const shapes::ShapeConstPtr& shape_ptr)
+{
+  const auto& shape = *shape_ptr;
+  hashCombine(seed, static_cast<int>(shape.type));
+  switch (shape.type)
+  {
+    case shapes::ShapeType::BOX:
+    {
+      const auto& box = static_cast<const shapes::Box&>(shape);
+      for (const double size : box.size)
+        hashCombine(seed, size);
+      break;
+    }
+    case shapes::ShapeType::SPHERE:
+      hashCombine(seed, static_cast<const shapes::Sphere&>(shape).radius);
+      break;
+    case shapes::ShapeType::CYLINDER:
+    {
+      const auto& cylinder = static_cast<const shapes::Cylinder&>(shape);
+      hashCombine(seed, cylinder.radius);
+      hashCombine(seed, cylinder.length);
+      break;
+    }
+    case shapes::ShapeType::CONE:
+    {
+      const auto& cone = static_cast<const shapes::Cone&>(shape);
+      hashCombine(seed, cone.radius);
+      hashCombine(seed, cone.length);
+      break;
+    }
+    case shapes::ShapeType::MESH:
+      hashCombine(seed, getMeshHash(shape_ptr));
+      break;
+    default:
+      // Other shapes are not transcribed, their type is enough to tell them apart
+      break;
+  }
+}
+
+/**
+ * @brief Computes a content hash of the planning scene world and the allowed collision matrix.
+ * @details Only the default entries and the explicit entries between names without a default entry are looked up,
+ * since a default entry takes precedence over the explicit ones of its name. World objects without any entry do not
+ * add lookups, which keeps the fingerprint cheap for scenes with many objects.
+ * @param planning_scene The planning scene.
+ * @param allowed_collisions The collisions the matrix always allows, collected while hashing the matrix so that it
+ * only has to be walked once.
+ * @return The content hash.
+ */
+std::size_t computeSceneFingerprint(const planning_scene::PlanningScene& planning_scene,
+                                    AllowedCollisions& allowed_collisions)
+{
+  std::size_t seed = 0;
+  const auto& world = planning_scene.getWorld();
+  for (const auto& object_id : world->getObjectIds())
+  {
+    const auto& collision_object = world->getObject(object_id);
+    if (!collision_object)
+      continue;
+    hashCombine(seed, object_id);
+    for (size_t i = 0; i < collision_object->shapes_.size(); ++i)
+    {
+      hashShape(seed, collision_object->shapes_[i]);
+      hashPose(seed, collision_object->global_shape_poses_[i]);
+    }
+  }
+
+  const auto& acm = planning_scene.getAllowedCollisionMatrix();
+  std::vector<std::string> names;
+  acm.getAllEntryNames(names);
+
+  allowed_collisions = AllowedCollisions();
+  std::vector<std::string> entry_names;
+  collision_detection::AllowedCollision::Type type;
+  for (const auto& name : names)
+  {
+    if (acm.getDefaultEntry(name, type))
+    {
+      hashCombine(seed, name);
+      hashCombine(seed, static_cast<int>(type));
+      if (type == collision_detection::AllowedCollision::ALWAYS)
+        allowed_collisions.always_allowed_names.push_back(name);
+      else
+        allowed_collisions.restricted_names.push_back(name);
+    }
+    else if (acm.hasEntry(name))
+    {
+      entry_names.push_back(name);
+    }
+  }
+
+  for (size_t i = 0; i < entry_names.size(); ++i)
+  {
+    for (size_t j = i + 1; j < entry_names.size(); ++j)
+    {
+      if (acm.getEntry(entry_names[i], entry_names[j], type) && type == collision_detection::AllowedCollision::ALWAYS)
+      {
+        hashCombine(seed, entry_names[i]);
+        hashCombine(seed, entry_names[j]);
+        allowed_collisions.pairs.emplace_back(entry_names[i], entry_names[j]);
+      }
+    }
+  }
+  return seed;
+}
 }  // namespace
 
 KTOptPlanningContext::KTOptPlanningContext(const std::string& name, const std::string& group_name,
@@ -60,53 +455,278 @@ void KTOptPlanningContext::solve(planning_interface::MotionPlanResponse& res)
   res.planner_id = std::string("ktopt");
   res.error_code.val = moveit_msgs::msg::MoveItErrorCodes::SUCCESS;
 
-  // some drake related scope initialisations
-  const auto& plant = diagram_->GetDowncastSubsystemByName<MultibodyPlant<double>>("plant");
-
   // Retrieve motion plan request
   const auto& req = getMotionPlanRequest();
+
+  // Start the wall-clock budget of this request
+  deadline_ = req.allowed_planning_time > 0.0 ?
+                  std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                                         std::chrono::duration<double>(req.allowed_planning_time)) :
+                  std::chrono::steady_clock::time_point::max();
+
+  // some drake related scope initialisations
+  const auto& plant = *model_->plant;
+
   const moveit::core::RobotState start_state(*getPlanningScene()->getCurrentStateUpdated(req.start_state));
   const auto joint_model_group = getPlanningScene()->getRobotModel()->getJointModelGroup(getGroupName());
   RCLCPP_INFO_STREAM(getLogger(), "Planning for group: " << getGroupName());
 
-  // Get velocity and acceleration bounds
-  Eigen::VectorXd lower_position_bounds;
-  Eigen::VectorXd upper_position_bounds;
-  Eigen::VectorXd lower_velocity_bounds;
-  Eigen::VectorXd upper_velocity_bounds;
-  Eigen::VectorXd lower_acceleration_bounds;
-  Eigen::VectorXd upper_acceleration_bounds;
-  Eigen::VectorXd lower_jerk_bounds;
-  Eigen::VectorXd upper_jerk_bounds;
-
-  moveit::drake::getPositionBounds(joint_model_group, plant, lower_position_bounds, upper_position_bounds);
-  moveit::drake::getVelocityBounds(joint_model_group, plant, lower_velocity_bounds, upper_velocity_bounds);
-  moveit::drake::getAccelerationBounds(joint_model_group, plant, lower_acceleration_bounds, upper_acceleration_bounds);
-  moveit::drake::getJerkBounds(joint_model_group, plant, lower_jerk_bounds, upper_jerk_bounds);
+  // The joint index map only depends on the robot model, the group and the plant, reuse it while they stay the same
+  if (!joint_index_map_ || joint_index_map_->getJointModelGroup() != joint_model_group)
+  {
+    joint_index_map_.emplace(joint_model_group, plant);
+  }
 
   // q represents the complete state (joint positions and velocities)
   Eigen::VectorXd q = Eigen::VectorXd::Zero(plant.num_positions() + plant.num_velocities());
-  q << moveit::drake::getJointPositionVector(start_state, getGroupName(), plant);
-  q << moveit::drake::getJointVelocityVector(start_state, getGroupName(), plant);
+  joint_index_map_->getPositions(start_state, q.head(plant.num_positions()));
+  joint_index_map_->getVelocities(start_state, q.tail(plant.num_velocities()));
 
   // drake accepts a VectorX<T>
-  auto& plant_context = diagram_->GetMutableSubsystemContext(plant, diagram_context_.get());
+  auto& plant_context = model_->diagram->GetMutableSubsystemContext(plant, diagram_context_.get());
   plant.SetPositionsAndVelocities(&plant_context, q);
 
-  // retrieve goal state
-  moveit::core::RobotState goal_state(start_state);
+  // retrieve goal states, every sample is solved separately so that a bad IK branch does not decide the outcome
   constraint_samplers::ConstraintSamplerManager sampler_manager;
   auto goal_sampler = sampler_manager.selectSampler(getPlanningScene(), getGroupName(), req.goal_constraints[0]);
-  if (!goal_sampler || !goal_sampler->sample(goal_state))
+  if (!goal_sampler)
+  {
+    res.error_code.val = moveit_msgs::msg::MoveItErrorCodes::INVALID_GOAL_CONSTRAINTS;
+    return;
+  }
+  const auto sampling_deadline =
+      std::min(deadline_, std::chrono::steady_clock::now() +
+                              std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                  std::chrono::duration<double>(params_.goal_sampling_time)));
+  std::vector<moveit::core::RobotState> goal_states;
+  goal_states.reserve(params_.num_goal_samples);
+  while (goal_states.size() < static_cast<std::size_t>(params_.num_goal_samples))
+  {
+    moveit::core::RobotState goal_state(start_state);
+    if (goal_sampler->sample(goal_state))
+    {
+      goal_states.push_back(std::move(goal_state));
+    }
+    // The budget is checked after sampling, so that at least one sample is always attempted
+    if (std::chrono::steady_clock::now() > sampling_deadline)
+    {
+      break;
+    }
+  }
+  if (goal_states.empty())
   {
     res.error_code.val = moveit_msgs::msg::MoveItErrorCodes::INVALID_GOAL_CONSTRAINTS;
     return;
   }
+  RCLCPP_DEBUG(getLogger(), "Sampled %zu goal states", goal_states.size());
+
+  // Check the duration constraints before setting up any problem
+  if (params_.min_trajectory_time > params_.max_trajectory_time)
+  {
+    RCLCPP_ERROR(getLogger(), "Minimum trajectory time cannot be greater than maximum trajectory time.");
+    res.error_code.val = moveit_msgs::msg::MoveItErrorCodes::PLANNING_FAILED;
+    return;
+  }
+
+  // The solvers do not depend on the individual problems, so they are resolved once per stage
+  const auto initial_stage_solver = makeSolver(params_.initial_stage_solver);
+  const auto collision_stage_solver = makeSolver(params_.collision_stage_solver);
+  if (!initial_stage_solver || !collision_stage_solver)
+  {
+    RCLCPP_ERROR(getLogger(), "No nonlinear solver is available in this Drake build.");
+    res.error_code.val = moveit_msgs::msg::MoveItErrorCodes::PLANNING_FAILED;
+    return;
+  }
+
+  // Every combination of goal sample and start is an independent problem. Solvers that are not thread-safe, e.g.
+  // IPOPT with MUMPS, solve them one after another.
+  const auto num_starts = static_cast<std::size_t>(params_.num_multi_starts);
+  const auto num_problems = goal_states.size() * num_starts;
+  const bool solve_in_parallel = thread_pool_ && num_problems > 1 && initial_stage_solver->is_thread_safe() &&
+                                 collision_stage_solver->is_thread_safe();
+  if (thread_pool_ && num_problems > 1 && !solve_in_parallel)
+  {
+    RCLCPP_DEBUG(getLogger(), "Solving %zu problems sequentially, the solver is not thread-safe", num_problems);
+  }
+
+  // Concurrent solves need their own diagram contexts, so that they do not share plant and scene graph caches. There
+  // is one set of contexts per thread that can solve at the same time, which is handed from one problem to the next.
+  // The sets are kept across solves until the transcribed scene changes.
+  const auto num_problem_contexts = solve_in_parallel ? std::min(num_problems, thread_pool_->size() + 1) : 1;
+  while (problem_contexts_.size() < num_problem_contexts)
+  {
+    problem_contexts_.push_back(std::make_unique<PathSampleContexts>(*diagram_context_));
+  }
+  std::vector<PathSampleContexts*> idle_problem_contexts;
+  for (std::size_t i = 0; i < num_problem_contexts; ++i)
+  {
+    idle_problem_contexts.push_back(problem_contexts_[i].get());
+  }
+  std::mutex problem_contexts_mutex;
+
+  // With "first_feasible", the remaining problems are abandoned as soon as one of them succeeds
+  std::atomic<bool> solution_found{ false };
+  const bool stop_at_first_solution = params_.multi_start_selection == "first_feasible";
+  std::vector<KTOptSolution> solutions(num_problems);
+  const auto solve_problem = [&](std::size_t problem_index) {
+    PathSampleContexts* problem_contexts = nullptr;
+    {
+      std::lock_guard<std::mutex> lock(problem_contexts_mutex);
+      problem_contexts = idle_problem_contexts.back();
+      idle_problem_contexts.pop_back();
+    }
+    const auto release_problem_contexts = [&] {
+      std::lock_guard<std::mutex> lock(problem_contexts_mutex);
+      idle_problem_contexts.push_back(problem_contexts);
+    };
+    try
+    {
+      solutions[problem_index] = solveFromStart(
+          start_state, goal_states[problem_index / num_starts], problem_index % num_starts, *problem_contexts,
+          *initial_stage_solver, *collision_stage_solver, stop_at_first_solution ? &solution_found : nullptr);
+    }
+    catch (...)
+    {
+      release_problem_contexts();
+      throw;
+    }
+    release_problem_contexts();
+    if (solutions[problem_index].trajectory)
+    {
+      solution_found = true;
+    }
+  };
+  if (solve_in_parallel)
+  {
+    thread_pool_->parallelFor(num_problems, solve_problem);
+  }
+  else
+  {
+    for (std::size_t i = 0; i < num_problems && !(stop_at_first_solution && solution_found); ++i)
+    {
+      solve_problem(i);
+    }
+  }
+
+  // A terminated request discards its solutions, a request that ran out of time still returns the ones it found
+  if (terminate_requested_)
+  {
+    setCancelledErrorCode(res);
+    return;
+  }
+
+  // Pick the best solution according to the selection metric
+  const KTOptSolution* best_solution = nullptr;
+  double best_metric = std::numeric_limits<double>::infinity();
+  for (const auto& solution : solutions)
+  {
+    if (!solution.trajectory)
+    {
+      continue;
+    }
+    double metric = solution.cost;
+    if (params_.solution_selection_metric == "duration")
+    {
+      metric = solution.trajectory->end_time() - solution.trajectory->start_time();
+    }
+    else if (params_.solution_selection_metric == "path_length")
+    {
+      metric = getPathLength(*solution.trajectory);
+    }
+    if (!best_solution || metric < best_metric)
+    {
+      best_solution = &solution;
+      best_metric = metric;
+    }
+  }
+  if (!best_solution)
+  {
+    if (isCancelled())
+    {
+      setCancelledErrorCode(res);
+      return;
+    }
+    RCLCPP_ERROR(getLogger(), "Trajectory optimization failed");
+    res.error_code.val = moveit_msgs::msg::MoveItErrorCodes::PLANNING_FAILED;
+    return;
+  }
+
+  // package up the resulting trajectory
+  const auto& traj = *best_solution->trajectory;
+  res.trajectory = std::make_shared<robot_trajectory::RobotTrajectory>(start_state.getRobotModel(), joint_model_group);
+
+  const auto times = params_.trajectory_sampling == "adaptive" ?
+                         moveit::drake::getAdaptiveSampleTimes(traj, params_.trajectory_time_step,
+                                                               params_.trajectory_sampling_tolerance) :
+                         moveit::drake::getUniformSampleTimes(traj, params_.trajectory_time_step);
+  moveit::drake::getRobotTrajectory(traj, times, *joint_index_map_, res.trajectory);
+
+  // Consumers of the compact B-spline get it before the context is cleared and handed to the next request
+  std::shared_ptr<const BsplineTrajectoryCallback> callback;
+  {
+    std::lock_guard<std::mutex> lock(bspline_trajectory_callback_mutex);
+    callback = bspline_trajectory_callback;
+  }
+  if (callback)
+  {
+    (*callback)(req, moveit::drake::getBsplineTrajectoryData(traj, *joint_index_map_));
+  }
+
+  // Visualize the trajectory with Meshcat, this does not hold up planning
+  if (params_.meshcat_visualise)
+  {
+    visualize(&traj);
+  }
+  res.error_code.val = moveit_msgs::msg::MoveItErrorCodes::SUCCESS;
+  return;
+}
+
+KTOptPlanningContext::KTOptSolution
+KTOptPlanningContext::solveFromStart(const moveit::core::RobotState& start_state,
+                                     const moveit::core::RobotState& goal_state, std::size_t start_index,
+                                     PathSampleContexts& sample_contexts,
+                                     const drake::solvers::SolverInterface& initial_stage_solver,
+                                     const drake::solvers::SolverInterface& collision_stage_solver,
+                                     const std::atomic<bool>* abandoned) const
+{
+  const auto& plant = *model_->plant;
+  auto& plant_context = model_->diagram->GetMutableSubsystemContext(plant, &sample_contexts.getDiagramContext());
+  const auto& joint_index_map = *joint_index_map_;
+
+  // Get velocity and acceleration bounds
+  Eigen::VectorXd lower_position_bounds;
+  Eigen::VectorXd upper_position_bounds;
+  Eigen::VectorXd lower_velocity_bounds;
+  Eigen::VectorXd upper_velocity_bounds;
+  Eigen::VectorXd lower_acceleration_bounds;
+  Eigen::VectorXd upper_acceleration_bounds;
+  Eigen::VectorXd lower_jerk_bounds;
+  Eigen::VectorXd upper_jerk_bounds;
+
+  moveit::drake::getPositionBounds(joint_index_map, lower_position_bounds, upper_position_bounds);
+  moveit::drake::getVelocityBounds(joint_index_map, lower_velocity_bounds, upper_velocity_bounds);
+  moveit::drake::getAccelerationBounds(joint_index_map, lower_acceleration_bounds, upper_acceleration_bounds);
+  moveit::drake::getJerkBounds(joint_index_map, lower_jerk_bounds, upper_jerk_bounds);
 
   // compile into a Kinematic Trajectory Optimization problem
   auto trajopt = KinematicTrajectoryOptimization(plant.num_positions(), params_.num_control_points);
   auto& prog = trajopt.get_mutable_prog();
 
+  // Solvers evaluate this callback at every iterate. Only solvers without a native time limit are stopped by throwing
+  // from it, unwinding through the C and Fortran frames of the others is not safe.
+  SolveAttempt attempt;
+  attempt.abandoned = abandoned;
+  prog.AddVisualizationCallback(
+      [this, &attempt](const Eigen::Ref<const Eigen::VectorXd>& /*x*/) {
+        if (attempt.stop_from_callback &&
+            (isCancelled() || std::chrono::steady_clock::now() > attempt.stage_deadline ||
+             (attempt.abandoned && *attempt.abandoned)))
+        {
+          throw SolveCancelledError();
+        }
+      },
+      prog.decision_variables());
+
   // Add costs
   trajopt.AddDurationCost(params_.duration_cost_weight);
   trajopt.AddPathLengthCost(params_.path_length_cost_weight);
@@ -117,14 +737,14 @@ void KTOptPlanningContext::solve(planning_interface::MotionPlanResponse& res)
 
   // Constraints
   // Add constraints on start joint configuration and velocity
-  const auto& start_position = moveit::drake::getJointPositionVector(start_state, getGroupName(), plant);
+  const auto& start_position = moveit::drake::getJointPositionVector(start_state, joint_index_map);
   trajopt.AddPathPositionConstraint(start_position, start_position, 0.0);
-  const auto& start_velocity = moveit::drake::getJointVelocityVector(start_state, getGroupName(), plant);
+  const auto& start_velocity = moveit::drake::getJointVelocityVector(start_state, joint_index_map);
   trajopt.AddPathVelocityConstraint(start_velocity, start_velocity, 0.0);
   // Add constraint on end joint configuration and velocity
-  const auto& goal_position = moveit::drake::getJointPositionVector(goal_state, getGroupName(), plant);
+  const auto& goal_position = moveit::drake::getJointPositionVector(goal_state, joint_index_map);
   trajopt.AddPathPositionConstraint(goal_position, goal_position, 1.0);
-  const auto& goal_velocity = moveit::drake::getJointVelocityVector(goal_state, getGroupName(), plant);
+  const auto& goal_velocity = moveit::drake::getJointVelocityVector(goal_state, joint_index_map);
   trajopt.AddPathVelocityConstraint(goal_velocity, goal_velocity, 1.0);
 
   // Add constraints on joint kinematic limits.
@@ -134,80 +754,103 @@ void KTOptPlanningContext::solve(planning_interface::MotionPlanResponse& res)
   trajopt.AddJerkBounds(lower_jerk_bounds, upper_jerk_bounds);
 
   // Add constraints on duration
-  if (params_.min_trajectory_time > params_.max_trajectory_time)
-  {
-    RCLCPP_ERROR(getLogger(), "Minimum trajectory time cannot be greater than maximum trajectory time.");
-    res.error_code.val = moveit_msgs::msg::MoveItErrorCodes::PLANNING_FAILED;
-    return;
-  }
   trajopt.AddDurationConstraint(params_.min_trajectory_time, params_.max_trajectory_time);
 
   // process path_constraints
-  addPathPositionConstraints(trajopt, plant, plant_context, params_.position_constraint_padding);
-  addPathOrientationConstraints(trajopt, plant, plant_context, params_.orientation_constraint_padding);
+  addPathPositionConstraints(trajopt, plant, sample_contexts, params_.position_constraint_padding);
+  addPathOrientationConstraints(trajopt, plant, sample_contexts, params_.orientation_constraint_padding);
+
+  // Starts other than the first one get a different initial guess
+  setMultiStartInitialGuess(trajopt, start_position, goal_position,
+                            std::clamp(1.0, params_.min_trajectory_time, params_.max_trajectory_time),
+                            params_.multi_start_perturbation, start_index);
 
   // solve the program
-  auto result = drake::solvers::Solve(prog);
+  auto result = solveProgram(prog, initial_stage_solver, attempt);
 
   if (!result.is_success())
   {
-    RCLCPP_ERROR(getLogger(), "Trajectory optimization failed");
-    res.error_code.val = moveit_msgs::msg::MoveItErrorCodes::PLANNING_FAILED;
-    return;
+    RCLCPP_DEBUG(getLogger(), "Trajectory optimization failed for start %zu", start_index);
+    return KTOptSolution();
   }
 
-  RCLCPP_INFO(getLogger(), "Setting initial guess ...");
+  RCLCPP_DEBUG(getLogger(), "Setting initial guess for start %zu ...", start_index);
   // set the initial guess
   trajopt.SetInitialGuess(trajopt.ReconstructTrajectory(result));
 
   // add collision constraints
-  for (int s = 0; s < params_.num_collision_check_points; ++s)
-  {
-    // The constraint will be evaluated as if it is bound with variables corresponding to r(s).
-    trajopt.AddPathPositionConstraint(std::make_shared<drake::multibody::MinimumDistanceLowerBoundConstraint>(
-                                          &plant, params_.collision_check_lower_distance_bound, &plant_context),
-                                      static_cast<double>(s) / (params_.num_collision_check_points - 1));
-  }
+  // Pairs further apart than the influence distance are skipped by the broadphase of the distance query
+  const auto add_collision_constraints = [&](const std::vector<double>& path_parameters) {
+    addPathSamplesConstraint(trajopt, sample_contexts, path_parameters, [&](Context<double>* sample_plant_context) {
+      return std::make_shared<drake::multibody::MinimumDistanceLowerBoundConstraint>(
+          &plant, params_.collision_check_lower_distance_bound, sample_plant_context,
+          drake::solvers::MinimumValuePenaltyFunction{}, params_.collision_influence_distance_offset);
+    });
+  };
+  add_collision_constraints(getEvenlySpacedPathParameters(params_.num_collision_check_points));
 
   // The previous solution is used to warm-start the collision checked
   // optimization problem
-  auto collision_free_result = Solve(prog);
-
-  // package up the resulting trajectory
-  auto traj = trajopt.ReconstructTrajectory(collision_free_result);
-  res.trajectory = std::make_shared<robot_trajectory::RobotTrajectory>(start_state.getRobotModel(), joint_model_group);
-
-  moveit::drake::getRobotTrajectory(traj, params_.trajectory_time_step, plant, res.trajectory);
-
-  // Visualize the trajectory with Meshcat
+  auto collision_free_result = solveProgram(prog, collision_stage_solver, attempt);
 
-  // TODO: add to conversions
-  if (params_.meshcat_visualise)
+  // In adaptive mode, check points are added where the solution is in collision until it verifies
+  if (params_.collision_check_mode == "adaptive")
   {
-    visualizer_->StartRecording();
-    const auto num_pts = static_cast<size_t>(std::ceil(traj.end_time() / params_.trajectory_time_step) + 1);
-    for (unsigned int i = 0; i < num_pts; ++i)
+    const drake::multibody::MinimumDistanceLowerBoundConstraint verification_constraint(
+        &plant, params_.collision_check_lower_distance_bound, &plant_context,
+        drake::solvers::MinimumValuePenaltyFunction{}, params_.collision_influence_distance_offset);
+    const double tolerance = getFeasibilityTolerance(collision_stage_solver, params_.solver_feasibility_tolerance);
+    for (int refinement = 0; collision_free_result.is_success(); ++refinement)
     {
-      const auto t_scale = static_cast<double>(i) / static_cast<double>(num_pts - 1);
-      const auto t = std::min(t_scale, 1.0) * traj.end_time();
-      plant.SetPositions(&plant_context, traj.value(t));
-      auto& vis_context = visualizer_->GetMyContextFromRoot(*diagram_context_);
-      visualizer_->ForcedPublish(vis_context);
-      // Without these sleeps, the visualizer won't give you time to load your
-      // browser
-      // TODO: This should not hold up planning time
-      std::this_thread::sleep_for(std::chrono::milliseconds(static_cast<int>(params_.trajectory_time_step * 10000.0)));
+      const auto violations =
+          findCollisionViolations(trajopt.ReconstructTrajectory(collision_free_result), verification_constraint,
+                                  static_cast<int>(params_.num_collision_verification_points), tolerance);
+      if (violations.empty())
+      {
+        break;
+      }
+      if (refinement == params_.max_collision_refinements)
+      {
+        RCLCPP_DEBUG(getLogger(), "Trajectory for start %zu still in collision after %d refinements", start_index,
+                     refinement);
+        return KTOptSolution();
+      }
+      RCLCPP_DEBUG(getLogger(), "Adding %zu collision check points for start %zu", violations.size(), start_index);
+      add_collision_constraints(violations);
+      trajopt.SetInitialGuess(trajopt.ReconstructTrajectory(collision_free_result));
+      collision_free_result = solveProgram(prog, collision_stage_solver, attempt);
     }
-    visualizer_->StopRecording();
-    visualizer_->PublishRecording();
   }
-  res.error_code.val = moveit_msgs::msg::MoveItErrorCodes::SUCCESS;
-  return;
+
+  if (!collision_free_result.is_success())
+  {
+    RCLCPP_DEBUG(getLogger(), "Collision constrained trajectory optimization failed for start %zu", start_index);
+    return KTOptSolution();
+  }
+
+  KTOptSolution solution;
+  solution.cost = collision_free_result.get_optimal_cost();
+  solution.trajectory = trajopt.ReconstructTrajectory(collision_free_result);
+  return solution;
+}
+
+void KTOptPlanningContext::addPathSamplesConstraint(
+    KinematicTrajectoryOptimization& trajopt, PathSampleContexts& sample_contexts,
+    const std::vector<double>& path_parameters,
+    const PathSamplesConstraint::SampleConstraintFactory& make_sample_constraint) const
+{
+  // Samples evaluate in parallel on idle planning threads, within a parallel solve they mostly evaluate inline
+  trajopt.get_mutable_prog().AddConstraint(
+      std::make_shared<PathSamplesConstraint>(*model_->diagram, *model_->plant, sample_contexts, trajopt.basis(),
+                                              path_parameters, make_sample_constraint,
+                                              params_.parallel_constraint_evaluation ? thread_pool_ : nullptr),
+      PathSamplesConstraint::getVariables(trajopt.control_points()));
 }
 
 void KTOptPlanningContext::addPathPositionConstraints(KinematicTrajectoryOptimization& trajopt,
                                                       const MultibodyPlant<double>& plant,
-                                                      Context<double>& plant_context, const double padding)
+                                                      PathSampleContexts& sample_contexts,
+                                                      const double padding) const
 {
   // retrieve the motion planning request
   const auto& req = getMotionPlanRequest();
@@ -263,34 +906,24 @@ void KTOptPlanningContext::addPathPositionConstraints(KinematicTrajectoryOptimiz
                                             std::max(padding, primitive.dimensions[2] / 2.0 - padding));
 
     // Check if equality constraint
-    if (req.path_constraints.name == "use_equality_constraints")
-    {
-      // Add position constraint to each knot point of the trajectory
-      for (int i = 0; i < params_.num_position_equality_points; ++i)
-      {
-        trajopt.AddPathPositionConstraint(std::make_shared<drake::multibody::PositionConstraint>(
-                                              &plant, base_frame, X_AbarA, -offset_vec, offset_vec, link_ee_frame,
-                                              Eigen::Vector3d(0.0, 0.0, 0.0), &plant_context),
-                                          static_cast<double>(i) / (params_.num_position_equality_points - 1));
-      }
-    }
-    else
-    {
-      // Add position constraint to each knot point of the trajectory
-      for (int i = 0; i < params_.num_position_inequality_points; ++i)
-      {
-        trajopt.AddPathPositionConstraint(std::make_shared<drake::multibody::PositionConstraint>(
-                                              &plant, base_frame, X_AbarA, -offset_vec, offset_vec, link_ee_frame,
-                                              Eigen::Vector3d(0.0, 0.0, 0.0), &plant_context),
-                                          static_cast<double>(i) / (params_.num_position_inequality_points - 1));
-      }
-    }
+    const auto num_points = req.path_constraints.name == "use_equality_constraints" ?
+                                params_.num_position_equality_points :
+                                params_.num_position_inequality_points;
+
+    // Add position constraint to each knot point of the trajectory
+    addPathSamplesConstraint(trajopt, sample_contexts, getEvenlySpacedPathParameters(num_points),
+                             [&](Context<double>* sample_plant_context) {
+                               return std::make_shared<drake::multibody::PositionConstraint>(
+                                   &plant, base_frame, X_AbarA, -offset_vec, offset_vec, link_ee_frame,
+                                   Eigen::Vector3d(0.0, 0.0, 0.0), sample_plant_context);
+                             });
   }
 }
 
 void KTOptPlanningContext::addPathOrientationConstraints(KinematicTrajectoryOptimization& trajopt,
                                                          const MultibodyPlant<double>& plant,
-                                                         Context<double>& plant_context, const double padding)
+                                                         PathSampleContexts& sample_contexts,
+                                                         const double padding) const
 {
   // retrieve the motion planning request
   const auto& req = getMotionPlanRequest();
@@ -342,109 +975,280 @@ void KTOptPlanningContext::addPathOrientationConstraints(KinematicTrajectoryOpti
     const double theta_bound = orientation_constraint.absolute_x_axis_tolerance - padding;
 
     // Add orientation constraint to each knot point of the trajectory
-    for (int i = 0; i < params_.num_orientation_constraint_points; ++i)
-    {
-      trajopt.AddPathPositionConstraint(std::make_shared<drake::multibody::OrientationConstraint>(
-                                            &plant, link_ee_frame, drake::math::RotationMatrixd::Identity(), base_frame,
-                                            R_BbarB, theta_bound, &plant_context),
-                                        static_cast<double>(i) / (params_.num_orientation_constraint_points - 1));
-    }
+    addPathSamplesConstraint(trajopt, sample_contexts,
+                             getEvenlySpacedPathParameters(params_.num_orientation_constraint_points),
+                             [&](Context<double>* sample_plant_context) {
+                               return std::make_shared<drake::multibody::OrientationConstraint>(
+                                   &plant, link_ee_frame, drake::math::RotationMatrixd::Identity(), base_frame,
+                                   R_BbarB, theta_bound, sample_plant_context);
+                             });
   }
 }
 
 bool KTOptPlanningContext::terminate()
 {
-  RCLCPP_ERROR(getLogger(), "KTOptPlanningContext::terminate() is not implemented!");
+  terminate_requested_ = true;
   return true;
 }
 
-void KTOptPlanningContext::setRobotDescription(const std::string& robot_description)
+bool KTOptPlanningContext::isCancelled() const
 {
-  // also perform some drake related initialisations here
-  builder = std::make_unique<DiagramBuilder<double>>();
+  return terminate_requested_ || std::chrono::steady_clock::now() > deadline_;
+}
 
-  // meshcat experiment
-  const auto meshcat_params = drake::geometry::MeshcatParams();
-  meshcat_ = std::make_shared<drake::geometry::Meshcat>(meshcat_params);
+void KTOptPlanningContext::setCancelledErrorCode(planning_interface::MotionPlanResponse& res) const
+{
+  if (terminate_requested_)
+  {
+    RCLCPP_WARN(getLogger(), "Trajectory optimization was terminated");
+    res.error_code.val = moveit_msgs::msg::MoveItErrorCodes::PREEMPTED;
+  }
+  else
+  {
+    RCLCPP_WARN(getLogger(), "Trajectory optimization exceeded the allowed planning time");
+    res.error_code.val = moveit_msgs::msg::MoveItErrorCodes::TIMED_OUT;
+  }
+}
 
-  auto [plant, scene_graph] = drake::multibody::AddMultibodyPlantSceneGraph(builder.get(), 0.0);
+drake::solvers::MathematicalProgramResult
+KTOptPlanningContext::solveProgram(const drake::solvers::MathematicalProgram& prog,
+                                   const drake::solvers::SolverInterface& solver, SolveAttempt& attempt) const
+{
+  // Stages that are no longer needed are not started, running stages are bounded by the solver limits below
+  if (isCancelled() || (attempt.abandoned && *attempt.abandoned))
+  {
+    return drake::solvers::MathematicalProgramResult();
+  }
 
-  // Drake cannot handle stl files, so we convert them to obj. Make sure these files are available in your moveit config!
-  const auto description_with_obj = moveit::drake::replaceSTLWithOBJ(robot_description);
-  auto robot_instance = drake::multibody::Parser(&plant, &scene_graph);
+  // The stage ends at the earlier of the request deadline and the stage time limit, which is always set so that a
+  // terminated SNOPT or IPOPT stage keeps running for a bounded time only
+  attempt.stage_deadline =
+      std::min(deadline_, std::chrono::steady_clock::now() +
+                              std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                  std::chrono::duration<double>(params_.solver_time_limit)));
 
-  for (const auto& path : params_.external_robot_description)
-    robot_instance.package_map().PopulateFromFolder(path);
+  const double remaining_time = std::max(
+      std::chrono::duration<double>(attempt.stage_deadline - std::chrono::steady_clock::now()).count(), 1e-3);
 
-  robot_instance.AddModelsFromString(description_with_obj, ".urdf");
+  // Translate the configured iteration limit and tolerances into solver specific options, unset ones keep the defaults
+  drake::solvers::SolverOptions options;
+  if (solver.solver_id() == drake::solvers::SnoptSolver::id())
+  {
+    if (params_.num_iterations > 0)
+      options.SetOption(drake::solvers::SnoptSolver::id(), "Major iterations limit",
+                        static_cast<int>(params_.num_iterations));
+    if (params_.solver_feasibility_tolerance > 0.0)
+      options.SetOption(drake::solvers::SnoptSolver::id(), "Major feasibility tolerance",
+                        params_.solver_feasibility_tolerance);
+    if (params_.solver_optimality_tolerance > 0.0)
+      options.SetOption(drake::solvers::SnoptSolver::id(), "Major optimality tolerance",
+                        params_.solver_optimality_tolerance);
+    options.SetOption(drake::solvers::SnoptSolver::id(), "Time limit", remaining_time);
+  }
+  else if (solver.solver_id() == drake::solvers::IpoptSolver::id())
+  {
+    if (params_.num_iterations > 0)
+      options.SetOption(drake::solvers::IpoptSolver::id(), "max_iter", static_cast<int>(params_.num_iterations));
+    if (params_.solver_feasibility_tolerance > 0.0)
+      options.SetOption(drake::solvers::IpoptSolver::id(), "constr_viol_tol", params_.solver_feasibility_tolerance);
+    if (params_.solver_optimality_tolerance > 0.0)
+      options.SetOption(drake::solvers::IpoptSolver::id(), "tol", params_.solver_optimality_tolerance);
+    options.SetOption(drake::solvers::IpoptSolver::id(), "max_wall_time", remaining_time);
+  }
+  else if (solver.solver_id() == drake::solvers::NloptSolver::id())
+  {
+    if (params_.num_iterations > 0)
+      options.SetOption(drake::solvers::NloptSolver::id(), drake::solvers::NloptSolver::MaxEvalName(),
+                        static_cast<int>(params_.num_iterations));
+    if (params_.solver_feasibility_tolerance > 0.0)
+      options.SetOption(drake::solvers::NloptSolver::id(), drake::solvers::NloptSolver::ConstraintToleranceName(),
+                        params_.solver_feasibility_tolerance);
+  }
 
-  if (!params_.base_frame.empty())
-    plant.WeldFrames(plant.world_frame(), plant.GetFrameByName(params_.base_frame));
+  // Solvers without a time limit option, i.e. NLopt, are stopped by the solver callback once the stage deadline has
+  // passed
+  attempt.stop_from_callback = solver.solver_id() != drake::solvers::SnoptSolver::id() &&
+                               solver.solver_id() != drake::solvers::IpoptSolver::id();
+  drake::solvers::MathematicalProgramResult result;
+  try
+  {
+    solver.Solve(prog, std::nullopt, options, &result);
+  }
+  catch (const SolveCancelledError&)
+  {
+    // The result of a stopped solve reports a failure
+    return drake::solvers::MathematicalProgramResult();
+  }
+  return result;
+}
+
+void KTOptPlanningContext::setDrakeModel(const std::shared_ptr<const DrakeModel>& model)
+{
+  if (model_ != model)
+  {
+    model_ = model;
+    diagram_context_ = model_->diagram->CreateDefaultContext();
+    problem_contexts_.clear();
+    transcribed_objects_.clear();
+    scene_fingerprint_.reset();
+    allowed_collision_filter_id_.reset();
+    nominal_q_ = model_->plant->GetDefaultPositions();
+    joint_index_map_.reset();
+  }
 
   // planning scene transcription
   const auto scene = getPlanningScene();
   transcribePlanningScene(*scene);
 
-  // for now finalize plant here
-  plant.Finalize();
-
-  // Apply MeshCat visualization
-  drake::visualization::VisualizationConfig config;
-  drake::visualization::ApplyVisualizationConfig(config, builder.get(), /*lcm_buses*/ nullptr, &plant, &scene_graph,
-                                                 meshcat_);
-
-  drake::geometry::MeshcatVisualizerParams meshcat_viz_params;
-  auto& visualizer = drake::geometry::MeshcatVisualizer<double>::AddToBuilder(builder.get(), scene_graph, meshcat_,
-                                                                              std::move(meshcat_viz_params));
-  visualizer_ = &visualizer;
+  visualize(nullptr);
+}
 
-  // in the future you can add other LeafSystems here. For now building the
-  // diagram
-  diagram_ = builder->Build();
-  diagram_context_ = diagram_->CreateDefaultContext();
+const std::shared_ptr<const DrakeModel>& KTOptPlanningContext::getDrakeModel() const
+{
+  return model_;
+}
 
-  auto& plant_context = diagram_->GetMutableSubsystemContext(plant, diagram_context_.get());
+void KTOptPlanningContext::visualize(const drake::trajectories::Trajectory<double>* trajectory) const
+{
+  if (!model_->visualization_worker)
+  {
+    return;
+  }
 
-  nominal_q_ = plant.GetPositions(plant_context);
+  // The job runs on the visualization worker, so it gets its own copies of the diagram context and trajectory. The
+  // worker is stopped before the model is destroyed, so the model's systems outlive the job.
+  std::shared_ptr<Context<double>> diagram_context = diagram_context_->Clone();
+  std::shared_ptr<drake::trajectories::Trajectory<double>> trajectory_copy =
+      trajectory ? trajectory->Clone() : nullptr;
+  const auto* diagram = model_->diagram.get();
+  const auto* plant = model_->plant;
+  auto* visualizer = model_->visualizer;
+  const double time_step = params_.trajectory_time_step;
+
+  model_->visualization_worker->post([=] {
+    auto& plant_context = diagram->GetMutableSubsystemContext(*plant, diagram_context.get());
+    const auto& vis_context = visualizer->GetMyContextFromRoot(*diagram_context);
+    if (!trajectory_copy)
+    {
+      visualizer->ForcedPublish(vis_context);
+      return;
+    }
 
-  auto& vis_context = visualizer_->GetMyContextFromRoot(*diagram_context_);
-  visualizer_->ForcedPublish(vis_context);
+    // Frames are recorded at their trajectory time, so the animation plays back in real time in the browser
+    visualizer->StartRecording(/* set_transforms_while_recording */ false);
+    const auto times = moveit::drake::getUniformSampleTimes(*trajectory_copy, time_step);
+    Eigen::MatrixXd positions;
+    moveit::drake::sampleTrajectory(*trajectory_copy, times, positions);
+    Eigen::VectorXd position(positions.cols());
+    for (std::size_t i = 0; i < times.size(); ++i)
+    {
+      diagram_context->SetTime(times[i]);
+      position = positions.row(i).transpose();
+      plant->SetPositions(&plant_context, position);
+      visualizer->ForcedPublish(vis_context);
+    }
+    visualizer->StopRecording();
+    visualizer->PublishRecording();
+  });
 }
 
 void KTOptPlanningContext::transcribePlanningScene(const planning_scene::PlanningScene& planning_scene)
 {
-  // Transcribe the planning scene into a drake scene graph
-  try
+  // Skip the transcription altogether if the scene is identical to the one transcribed before
+  AllowedCollisions allowed_collisions;
+  const auto scene_fingerprint = computeSceneFingerprint(planning_scene, allowed_collisions);
+  if (scene_fingerprint_ == scene_fingerprint)
   {
-    auto world = planning_scene.getWorld();
+    ++scene_cache_hits;
+    RCLCPP_DEBUG(getLogger(), "Planning scene %zx unchanged (scene cache hits: %zu, misses: %zu)", scene_fingerprint,
+                 scene_cache_hits.load(), scene_cache_misses.load());
+    return;
   }
-  catch (const std::exception& e)
+  ++scene_cache_misses;
+  RCLCPP_DEBUG(getLogger(), "Transcribing planning scene %zx (scene cache hits: %zu, misses: %zu)", scene_fingerprint,
+               scene_cache_hits.load(), scene_cache_misses.load());
+  scene_fingerprint_ = scene_fingerprint;
+
+  // The copies of the diagram context are made again from the updated scene by the next solve
+  problem_contexts_.clear();
+
+  // Apply the differences between the MoveIt world and the transcribed scene graph context of this planner
+  const auto& scene_graph = *model_->scene_graph;
+  auto& scene_graph_context = model_->diagram->GetMutableSubsystemContext(scene_graph, diagram_context_.get());
+  const auto source_id = model_->planning_scene_source_id;
+  const auto& world = planning_scene.getWorld();
+
+  // The filter refers to transcribed geometries, so it is removed before they change and applied again afterwards
+  removeAllowedCollisionFilter();
+
+  // Remove objects that no longer exist
+  for (auto it = transcribed_objects_.begin(); it != transcribed_objects_.end();)
   {
-    RCLCPP_ERROR_STREAM(getLogger(), "caught exception ... " << e.what());
+    if (!world->hasObject(it->first))
+    {
+      removeTranscribedObject(it->second);
+      it = transcribed_objects_.erase(it);
+    }
+    else
+    {
+      ++it;
+    }
   }
-  auto& scene_graph = builder->GetMutableDowncastSubsystemByName<drake::geometry::SceneGraph<double>>("scene_graph");
-  for (const auto& object : planning_scene.getWorld()->getObjectIds())
+
+  for (const auto& object : world->getObjectIds())
   {
-    const auto& collision_object = planning_scene.getWorld()->getObject(object);
+    const auto& collision_object = world->getObject(object);
     if (!collision_object)
     {
       RCLCPP_INFO(getLogger(), "No collision object");
-      return;
+      continue;
     }
     if (object == kOctomapNamespace)
     {
       RCLCPP_WARN(getLogger(), "Octomap not supported for now ... ");
       continue;
     }
+
+    const auto transcribed_it = transcribed_objects_.find(object);
+    if (transcribed_it != transcribed_objects_.end())
+    {
+      auto& transcribed_object = transcribed_it->second;
+      if (transcribed_object.shapes == collision_object->shapes_)
+      {
+        // Same shapes, only move the geometries whose pose changed
+        for (size_t i = 0; i < transcribed_object.shapes.size(); ++i)
+        {
+          const auto& pose = collision_object->global_shape_poses_[i];
+          const auto& geom_id = transcribed_object.geometry_ids[i];
+          if (!geom_id.is_valid() || pose.isApprox(transcribed_object.shape_poses[i]))
+          {
+            continue;
+          }
+          const auto& query_object =
+              scene_graph.get_query_output_port().Eval<drake::geometry::QueryObject<double>>(scene_graph_context);
+          const auto shape = query_object.inspector().GetShape(geom_id).Clone();
+          scene_graph.ChangeShape(&scene_graph_context, source_id, geom_id, *shape, drake::math::RigidTransformd(pose));
+        }
+        transcribed_object.shape_poses = collision_object->global_shape_poses_;
+        continue;
+      }
+
+      // Different shapes, transcribe the object from scratch
+      removeTranscribedObject(transcribed_object);
+      transcribed_objects_.erase(transcribed_it);
+    }
+
+    TranscribedObject transcribed_object;
+    transcribed_object.shapes = collision_object->shapes_;
+    transcribed_object.shape_poses = collision_object->global_shape_poses_;
     for (size_t i = 0; i < collision_object->shapes_.size(); ++i)
     {
       const std::string shape_name = object + std::to_string(i);
       const auto& shape = collision_object->shapes_[i];
-      const auto& pose = collision_object->pose_;
-      const auto& shape_type = collision_object->shapes_[i]->type;
+      const auto& pose = collision_object->global_shape_poses_[i];
 
       std::unique_ptr<drake::geometry::Shape> shape_ptr;
-      switch (shape_type)
+      switch (shape->type)
       {
         case shapes::ShapeType::BOX:
         {
@@ -465,6 +1269,33 @@ void KTOptPlanningContext::transcribePlanningScene(const planning_scene::Plannin
           shape_ptr = std::make_unique<drake::geometry::Cylinder>(object_ptr->radius, object_ptr->length);
           break;
         }
+        case shapes::ShapeType::MESH:
+        {
+          // Drake loads meshes from files, which are cached by mesh content together with their convex hulls
+          const auto object_ptr = std::dynamic_pointer_cast<const shapes::Mesh>(shape);
+          const auto mesh_cache_directory = params_.mesh_cache_directory.empty() ?
+                                                moveit::drake::getDefaultMeshCacheDirectory() :
+                                                std::filesystem::path(params_.mesh_cache_directory);
+          try
+          {
+            if (params_.mesh_collision_shape == "mesh")
+            {
+              shape_ptr = std::make_unique<drake::geometry::Mesh>(
+                  moveit::drake::convertMeshToOBJ(*object_ptr, mesh_cache_directory, false).string());
+            }
+            else
+            {
+              shape_ptr = std::make_unique<drake::geometry::Convex>(
+                  moveit::drake::convertMeshToOBJ(*object_ptr, mesh_cache_directory, true).string());
+            }
+          }
+          catch (const std::exception& e)
+          {
+            RCLCPP_WARN(getLogger(), "Cannot convert mesh of '%s', ignoring in scene graph: %s", shape_name.c_str(),
+                        e.what());
+          }
+          break;
+        }
         default:
         {
           RCLCPP_WARN(getLogger(), "Unsupported shape for '%s', ignoring in scene graph.", shape_name.c_str());
@@ -474,28 +1305,201 @@ void KTOptPlanningContext::transcribePlanningScene(const planning_scene::Plannin
 
       if (!shape_ptr)
       {
+        // Keep the geometry ids aligned with the shapes
+        transcribed_object.geometry_ids.emplace_back();
         continue;
       }
 
-      // Register the geometry in the scene graph.
-      const auto source_id = scene_graph.RegisterSource(shape_name);
-      const auto geom_id = scene_graph.RegisterAnchoredGeometry(
-          source_id, std::make_unique<drake::geometry::GeometryInstance>(drake::math::RigidTransformd(pose),
-                                                                         std::move(shape_ptr), shape_name));
+      // Register the geometry as anchored (attached to the world frame) in the scene graph context.
+      const auto geom_id = scene_graph.RegisterGeometry(
+          &scene_graph_context, source_id, scene_graph.world_frame_id(),
+          std::make_unique<drake::geometry::GeometryInstance>(drake::math::RigidTransformd(pose), std::move(shape_ptr),
+                                                              shape_name));
+      transcribed_object.geometry_ids.push_back(geom_id);
 
       // add illustration, proximity, perception properties
-      scene_graph.AssignRole(source_id, geom_id, drake::geometry::IllustrationProperties());
-      scene_graph.AssignRole(source_id, geom_id, drake::geometry::ProximityProperties());
-      scene_graph.AssignRole(source_id, geom_id, drake::geometry::PerceptionProperties());
+      scene_graph.AssignRole(&scene_graph_context, source_id, geom_id, drake::geometry::IllustrationProperties());
+      scene_graph.AssignRole(&scene_graph_context, source_id, geom_id, drake::geometry::ProximityProperties());
+      scene_graph.AssignRole(&scene_graph_context, source_id, geom_id, drake::geometry::PerceptionProperties());
 
       // TODO: Create and anchor ground entity
     }
+    transcribed_objects_.emplace(object, std::move(transcribed_object));
+  }
+
+  applyAllowedCollisionMatrix(allowed_collisions);
+}
+
+void KTOptPlanningContext::applyAllowedCollisionMatrix(const AllowedCollisions& allowed_collisions)
+{
+  const auto& plant = *model_->plant;
+  const auto& scene_graph = *model_->scene_graph;
+  auto& scene_graph_context = model_->diagram->GetMutableSubsystemContext(scene_graph, diagram_context_.get());
+
+  // Names are matched to transcribed world objects and plant bodies, names of neither have no geometry to filter
+  std::unordered_map<std::string, std::optional<drake::geometry::GeometrySet>> named_geometries;
+  const auto get_geometries = [&](const std::string& name) -> const std::optional<drake::geometry::GeometrySet>& {
+    const auto [it, inserted] = named_geometries.try_emplace(name);
+    if (!inserted)
+      return it->second;
+    const auto transcribed_it = transcribed_objects_.find(name);
+    if (transcribed_it != transcribed_objects_.end())
+    {
+      drake::geometry::GeometrySet geometries;
+      for (const auto& geom_id : transcribed_it->second.geometry_ids)
+      {
+        if (geom_id.is_valid())
+          geometries.Add(geom_id);
+      }
+      it->second = std::move(geometries);
+    }
+    else if (plant.HasBodyNamed(name))
+    {
+      // Links without geometry have no frame in the scene graph
+      const auto frame_id = plant.GetBodyFrameIdIfExists(plant.GetBodyByName(name).index());
+      if (frame_id)
+        it->second = drake::geometry::GeometrySet(*frame_id);
+    }
+    return it->second;
+  };
+
+  // Adjacent links are already filtered by the plant, the matrix adds the pairs the SRDF and the scene allow
+  drake::geometry::CollisionFilterDeclaration declaration;
+  std::size_t num_allowed_pairs = 0;
+  for (const auto& [name_a, name_b] : allowed_collisions.pairs)
+  {
+    const auto& geometries_a = get_geometries(name_a);
+    const auto& geometries_b = get_geometries(name_b);
+    if (geometries_a && geometries_b)
+    {
+      declaration.ExcludeBetween(*geometries_a, *geometries_b);
+      ++num_allowed_pairs;
+    }
+  }
+
+  // A default entry of ALWAYS allows collisions with every name, except those with a more restrictive default entry
+  std::size_t num_allowed_defaults = 0;
+  if (!allowed_collisions.always_allowed_names.empty())
+  {
+    const std::unordered_set<std::string> restricted_names(allowed_collisions.restricted_names.begin(),
+                                                           allowed_collisions.restricted_names.end());
+    drake::geometry::GeometrySet unrestricted_geometries;
+    for (const auto& [object_id, transcribed_object] : transcribed_objects_)
+    {
+      if (restricted_names.count(object_id))
+        continue;
+      for (const auto& geom_id : transcribed_object.geometry_ids)
+      {
+        if (geom_id.is_valid())
+          unrestricted_geometries.Add(geom_id);
+      }
+    }
+    for (drake::multibody::BodyIndex body_index(0); body_index < plant.num_bodies(); ++body_index)
+    {
+      const auto frame_id = plant.GetBodyFrameIdIfExists(body_index);
+      if (frame_id && !restricted_names.count(plant.get_body(body_index).name()))
+        unrestricted_geometries.Add(*frame_id);
+    }
+
+    for (const auto& name : allowed_collisions.always_allowed_names)
+    {
+      const auto& geometries = get_geometries(name);
+      if (geometries)
+      {
+        declaration.ExcludeBetween(*geometries, unrestricted_geometries);
+        ++num_allowed_defaults;
+      }
+    }
+  }
+
+  if (num_allowed_pairs > 0 || num_allowed_defaults > 0)
+  {
+    allowed_collision_filter_id_ =
+        scene_graph.collision_filter_manager(&scene_graph_context).ApplyTransient(declaration);
+  }
+  RCLCPP_DEBUG(getLogger(), "Filtered %zu allowed collision pairs and %zu allowed default entries", num_allowed_pairs,
+               num_allowed_defaults);
+}
+
+void KTOptPlanningContext::removeAllowedCollisionFilter()
+{
+  if (!allowed_collision_filter_id_)
+  {
+    return;
+  }
+  const auto& scene_graph = *model_->scene_graph;
+  auto& scene_graph_context = model_->diagram->GetMutableSubsystemContext(scene_graph, diagram_context_.get());
+  scene_graph.collision_filter_manager(&scene_graph_context).RemoveDeclaration(*allowed_collision_filter_id_);
+  allowed_collision_filter_id_.reset();
+}
+
+std::optional<std::size_t> KTOptPlanningContext::getSceneFingerprint() const
+{
+  return scene_fingerprint_;
+}
+
+SceneCacheStatistics KTOptPlanningContext::getSceneCacheStatistics()
+{
+  return SceneCacheStatistics{ scene_cache_hits.load(), scene_cache_misses.load() };
+}
+
+void KTOptPlanningContext::setBsplineTrajectoryCallback(BsplineTrajectoryCallback callback)
+{
+  std::shared_ptr<const BsplineTrajectoryCallback> shared_callback;
+  if (callback)
+  {
+    shared_callback = std::make_shared<const BsplineTrajectoryCallback>(std::move(callback));
+  }
+  std::lock_guard<std::mutex> lock(bspline_trajectory_callback_mutex);
+  bspline_trajectory_callback = std::move(shared_callback);
+}
+
+void KTOptPlanningContext::removeTranscribedObject(const TranscribedObject& transcribed_object)
+{
+  const auto& scene_graph = *model_->scene_graph;
+  auto& scene_graph_context = model_->diagram->GetMutableSubsystemContext(scene_graph, diagram_context_.get());
+  for (const auto& geom_id : transcribed_object.geometry_ids)
+  {
+    if (geom_id.is_valid())
+    {
+      scene_graph.RemoveGeometry(&scene_graph_context, model_->planning_scene_source_id, geom_id);
+    }
   }
 }
 
 void KTOptPlanningContext::clear()
 {
-  RCLCPP_ERROR(getLogger(), "KTOptPlanningContext::clear() is not implemented!");
-  // do something
+  terminate_requested_ = false;
+  planning_scene_.reset();
+  request_ = planning_interface::MotionPlanRequest();
+}
+
+void KTOptPlanningContext::setParams(const ktopt_interface::Params& params)
+{
+  // Meshes are transcribed differently with these parameters, so the transcribed scene is no longer valid
+  const bool mesh_transcription_changed = params.mesh_collision_shape != params_.mesh_collision_shape ||
+                                          params.mesh_cache_directory != params_.mesh_cache_directory;
+  params_ = params;
+  if (mesh_transcription_changed && model_)
+  {
+    removeAllowedCollisionFilter();
+    for (const auto& [object_id, transcribed_object] : transcribed_objects_)
+    {
+      removeTranscribedObject(transcribed_object);
+    }
+    transcribed_objects_.clear();
+    scene_fingerprint_.reset();
+    problem_contexts_.clear();
+  }
+}
+
+void KTOptPlanningContext::setThreadPool(const std::shared_ptr<ThreadPool>& thread_pool)
+{
+  thread_pool_ = thread_pool;
+}
+
+void KTOptPlanningContext::setGroupName(const std::string& group_name)
+{
+  group_ = group_name;
 }
 }  // namespace ktopt_interface
@@ -0,0 +1,140 @@
+#include <ktopt_interface/ktopt_planning_context_pool.hpp>
+
+namespace ktopt_interface
+{
+KTOptPlanningContextPool::KTOptPlanningContextPool(std::size_t max_size) : max_size_(max_size)
+{
+}
+
+std::shared_ptr<KTOptPlanningContext>
+KTOptPlanningContextPool::acquire(const std::string& group_name, const ktopt_interface::Params& params,
+                                  const std::shared_ptr<const DrakeModel>& model)
+{
+  std::unique_ptr<KTOptPlanningContext> context;
+  bool pooled = false;
+  // Dropped contexts are destroyed outside the lock, they may hold the last reference to their model
+  std::vector<std::unique_ptr<KTOptPlanningContext>> dropped;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    removeIdleContexts(model, dropped);
+
+    // Prefer an idle context that was last used for the same group, it is most likely to match the next scene too
+    auto& idle = idle_contexts_[group_name];
+    if (!idle.empty())
+    {
+      context = std::move(idle.back());
+      idle.pop_back();
+      pooled = true;
+    }
+    else
+    {
+      // Make room by evicting an idle context of another group
+      if (num_pooled_ >= max_size_)
+      {
+        for (auto& [name, contexts] : idle_contexts_)
+        {
+          if (!contexts.empty())
+          {
+            dropped.push_back(std::move(contexts.back()));
+            contexts.pop_back();
+            --num_pooled_;
+            break;
+          }
+        }
+      }
+      pooled = num_pooled_ < max_size_;
+      if (pooled)
+      {
+        ++num_pooled_;
+      }
+    }
+  }
+
+  if (context)
+  {
+    context->setGroupName(group_name);
+    context->setParams(params);
+  }
+  else
+  {
+    context = std::make_unique<KTOptPlanningContext>("KTOPT", group_name, params);
+  }
+
+  std::weak_ptr<KTOptPlanningContextPool> weak_pool = weak_from_this();
+  return std::shared_ptr<KTOptPlanningContext>(context.release(),
+                                               [weak_pool, pooled](KTOptPlanningContext* released_context) {
+                                                 if (const auto pool = weak_pool.lock())
+                                                 {
+                                                   pool->release(released_context, pooled);
+                                                 }
+                                                 else
+                                                 {
+                                                   delete released_context;
+                                                 }
+                                               });
+}
+
+void KTOptPlanningContextPool::dropIdleContexts(const std::shared_ptr<const DrakeModel>& model)
+{
+  std::vector<std::unique_ptr<KTOptPlanningContext>> dropped;
+  std::lock_guard<std::mutex> lock(mutex_);
+  removeIdleContexts(model, dropped);
+}
+
+void KTOptPlanningContextPool::setMaxSize(std::size_t max_size)
+{
+  std::vector<std::unique_ptr<KTOptPlanningContext>> dropped;
+  std::lock_guard<std::mutex> lock(mutex_);
+  max_size_ = max_size;
+  shrink(dropped);
+}
+
+void KTOptPlanningContextPool::release(KTOptPlanningContext* context, bool pooled)
+{
+  std::unique_ptr<KTOptPlanningContext> owned_context(context);
+  if (!pooled)
+  {
+    return;
+  }
+
+  owned_context->clear();
+  std::vector<std::unique_ptr<KTOptPlanningContext>> dropped;
+  std::lock_guard<std::mutex> lock(mutex_);
+  idle_contexts_[owned_context->getGroupName()].push_back(std::move(owned_context));
+  shrink(dropped);
+}
+
+void KTOptPlanningContextPool::shrink(std::vector<std::unique_ptr<KTOptPlanningContext>>& dropped)
+{
+  for (auto& [name, contexts] : idle_contexts_)
+  {
+    while (num_pooled_ > max_size_ && !contexts.empty())
+    {
+      dropped.push_back(std::move(contexts.back()));
+      contexts.pop_back();
+      --num_pooled_;
+    }
+  }
+}
+
+void KTOptPlanningContextPool::removeIdleContexts(const std::shared_ptr<const DrakeModel>& model,
+                                                  std::vector<std::unique_ptr<KTOptPlanningContext>>& dropped)
+{
+  for (auto& [name, contexts] : idle_contexts_)
+  {
+    for (auto it = contexts.begin(); it != contexts.end();)
+    {
+      if ((*it)->getDrakeModel() && (*it)->getDrakeModel() != model)
+      {
+        dropped.push_back(std::move(*it));
+        it = contexts.erase(it);
+        --num_pooled_;
+      }
+      else
+      {
+        ++it;
+      }
+    }
+  }
+}
+}  // namespace ktopt_interface
@@ -0,0 +1,360 @@
+/*********************************************************************
+ * Software License Agreement (BSD License)
+ *
+ *  Copyright (c) 2024, PickNik Inc.
+ *  All rights reserved.
+ *
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions
+ *  are met:
+ *
+ *   * Redistributions of source code must retain the above copyright
+ *     notice, this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above
+ *     copyright notice, this list of conditions and the following
+ *     disclaimer in the documentation and/or other materials provided
+ *     with the distribution.
+ *   * Neither the name of PickNik Inc. nor the names of its
+ *     contributors may be used to endorse or promote products derived
+ *     from this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *  "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *  LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ *  FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ *  COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ *  INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ *  BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ *  LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ *  CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ *  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN
+ *  ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *********************************************************************/
+
+/* Desc: Conversion of STL meshes referenced by robot descriptions to cached OBJ files
+ */
+
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <drake/geometry/shape_specification.h>
+
+#include <moveit/drake/conversions.hpp>
+#include <moveit/drake/mesh_conversion.hpp>
+#include <moveit/utils/logger.hpp>
+
+namespace moveit::drake
+{
+namespace
+{
+rclcpp::Logger getLogger()
+{
+  return moveit::getLogger("moveit.drake.mesh_conversion");
+}
+
+using Vertex = std::array<float, 3>;
+
+constexpr std::uint64_t kFnvOffsetBasis = 14695981039346656037ULL;
+constexpr std::uint64_t kFnvPrime = 1099511628211ULL;
+
+/// @brief 64-bit FNV-1a hash of a byte sequence
+std::uint64_t hashBytes(std::string_view bytes)
+{
+  std::uint64_t hash = kFnvOffsetBasis;
+  for (const char byte : bytes)
+  {
+    hash ^= static_cast<unsigned char>(byte);
+    hash *= kFnvPrime;
+  }
+  return hash;
+}
+
+std::string toHex(std::uint64_t value)
+{
+  char buffer[17];
+  std::snprintf(buffer, sizeof(buffer), "%016llx", static_cast<unsigned long long>(value));
+  return buffer;
+}
+
+std::string readFile(const std::filesystem::path& path)
+{
+  std::ifstream file(path, std::ios::binary);
+  if (!file)
+  {
+    throw std::runtime_error("Cannot open '" + path.string() + "'");
+  }
+  std::ostringstream content;
+  content << file.rdbuf();
+  return content.str();
+}
+
+/// @brief Write a file under a temporary name first, so that concurrent readers never see a partial file
+void writeFileAtomically(const std::filesystem::path& path, const std::string& content)
+{
+  std::random_device random_device;
+  const std::uint64_t suffix = (std::uint64_t{ random_device() } << 32) ^ random_device();
+  const auto temporary_path = path.parent_path() / (path.filename().string() + ".tmp" + toHex(suffix));
+  {
+    std::ofstream file(temporary_path, std::ios::binary | std::ios::trunc);
+    if (!file.write(content.data(), static_cast<std::streamsize>(content.size())))
+    {
+      throw std::runtime_error("Cannot write '" + temporary_path.string() + "'");
+    }
+  }
+  std::filesystem::rename(temporary_path, path);
+}
+
+/// @brief Parse the triangle corners of a binary or ASCII STL file, three vertices per triangle
+std::vector<Vertex> parseSTL(const std::string& content)
+{
+  std::vector<Vertex> corners;
+
+  // Binary files may start with "solid" as well, their size is the reliable criterion
+  constexpr std::size_t kHeaderSize = 84;
+  constexpr std::size_t kTriangleSize = 50;
+  if (content.size() >= kHeaderSize)
+  {
+    std::uint32_t num_triangles;
+    std::memcpy(&num_triangles, content.data() + 80, sizeof(num_triangles));
+    if (content.size() == kHeaderSize + kTriangleSize * num_triangles)
+    {
+      corners.resize(3 * std::size_t{ num_triangles });
+      for (std::size_t i = 0; i < num_triangles; ++i)
+      {
+        // Skip the facet normal, Drake computes its own
+        const char* triangle = content.data() + kHeaderSize + i * kTriangleSize + 3 * sizeof(float);
+        std::memcpy(corners[3 * i].data(), triangle, 9 * sizeof(float));
+      }
+      return corners;
+    }
+  }
+
+  std::istringstream stream(content);
+  std::string token;
+  while (stream >> token)
+  {
+    if (token == "vertex")
+    {
+      Vertex vertex;
+      if (!(stream >> vertex[0] >> vertex[1] >> vertex[2]))
+      {
+        throw std::runtime_error("Malformed vertex in ASCII STL");
+      }
+      corners.push_back(vertex);
+    }
+  }
+  if (corners.empty() || corners.size() % 3 != 0)
+  {
+    throw std::runtime_error("No triangles found in STL");
+  }
+  return corners;
+}
+
+/// @brief Serialize triangles as OBJ, merging identical vertices
+std::string toOBJ(const std::vector<Vertex>& corners)
+{
+  struct VertexHash
+  {
+    std::size_t operator()(const Vertex& vertex) const
+    {
+      return hashBytes(std::string_view(reinterpret_cast<const char*>(vertex.data()), sizeof(Vertex)));
+    }
+  };
+  std::unordered_map<Vertex, std::size_t, VertexHash> vertex_indices;
+  std::vector<std::size_t> face_indices;
+  face_indices.reserve(corners.size());
+
+  std::string obj = "# Converted from STL by moveit_drake\n";
+  char line[128];
+  for (const auto& corner : corners)
+  {
+    const auto [it, inserted] = vertex_indices.emplace(corner, vertex_indices.size() + 1);
+    if (inserted)
+    {
+      std::snprintf(line, sizeof(line), "v %.9g %.9g %.9g\n", corner[0], corner[1], corner[2]);
+      obj += line;
+    }
+    face_indices.push_back(it->second);
+  }
+  for (std::size_t i = 0; i < face_indices.size(); i += 3)
+  {
+    std::snprintf(line, sizeof(line), "f %zu %zu %zu\n", face_indices[i], face_indices[i + 1], face_indices[i + 2]);
+    obj += line;
+  }
+  return obj;
+}
+
+/// @brief Resolve a mesh filename from a robot description to a local path
+std::filesystem::path resolveMeshPath(const std::string& filename, const ::drake::multibody::PackageMap& package_map)
+{
+  if (filename.find("://") == std::string::npos)
+  {
+    return filename;
+  }
+  return package_map.ResolveUrl(filename);
+}
+}  // namespace
+
+std::filesystem::path getDefaultMeshCacheDirectory()
+{
+  if (const char* xdg_cache_home = std::getenv("XDG_CACHE_HOME"); xdg_cache_home && *xdg_cache_home)
+  {
+    return std::filesystem::path(xdg_cache_home) / "moveit_drake" / "meshes";
+  }
+  if (const char* home = std::getenv("HOME"); home && *home)
+  {
+    return std::filesystem::path(home) / ".cache" / "moveit_drake" / "meshes";
+  }
+  return std::filesystem::temp_directory_path() / "moveit_drake" / "meshes";
+}
+
+std::filesystem::path convertSTLToOBJ(const std::filesystem::path& stl_path,
+                                      const std::filesystem::path& cache_directory)
+{
+  const auto source_path = std::filesystem::absolute(stl_path);
+  const auto index_directory = cache_directory / "index";
+  std::filesystem::create_directories(index_directory);
+
+  // Serve unchanged sources from the index, without reading them
+  const auto file_size = std::filesystem::file_size(source_path);
+  const auto modification_time = std::filesystem::last_write_time(source_path).time_since_epoch().count();
+  const auto index_path = index_directory / toHex(hashBytes(source_path.string()));
+  {
+    std::ifstream index(index_path);
+    std::uintmax_t indexed_size;
+    long long indexed_time;
+    std::string indexed_hash;
+    if (index >> indexed_size >> indexed_time >> indexed_hash && indexed_size == file_size &&
+        indexed_time == static_cast<long long>(modification_time))
+    {
+      const auto obj_path = cache_directory / (indexed_hash + ".obj");
+      if (std::filesystem::exists(obj_path))
+      {
+        return obj_path;
+      }
+    }
+  }
+
+  const auto content = readFile(source_path);
+  const auto content_hash = toHex(hashBytes(content));
+  const auto obj_path = cache_directory / (content_hash + ".obj");
+  if (!std::filesystem::exists(obj_path))
+  {
+    RCLCPP_INFO(getLogger(), "Converting '%s' to '%s'", source_path.c_str(), obj_path.c_str());
+    writeFileAtomically(obj_path, toOBJ(parseSTL(content)));
+  }
+  writeFileAtomically(index_path, std::to_string(file_size) + ' ' +
+                                      std::to_string(static_cast<long long>(modification_time)) + ' ' + content_hash +
+                                      '\n');
+  return obj_path;
+}
+
+std::string convertSTLMeshesToOBJ(const std::string& input, const ::drake::multibody::PackageMap& package_map,
+                                  const std::filesystem::path& cache_directory)
+{
+  // Descriptions usually reference the same mesh several times, e.g. for visual and collision geometry
+  std::unordered_map<std::string, std::string> replacements;
+  const auto get_replacement = [&](const std::string& filename) -> const std::string& {
+    auto it = replacements.find(filename);
+    if (it != replacements.end())
+    {
+      return it->second;
+    }
+    std::string replacement;
+    try
+    {
+      replacement = convertSTLToOBJ(resolveMeshPath(filename, package_map), cache_directory).string();
+    }
+    catch (const std::exception& e)
+    {
+      RCLCPP_WARN(getLogger(), "Cannot convert mesh '%s', expecting an OBJ file next to it: %s", filename.c_str(),
+                  e.what());
+      replacement = filename.substr(0, filename.size() - 4) + ".obj";
+    }
+    return replacements.emplace(filename, std::move(replacement)).first->second;
+  };
+
+  return rewriteMeshFilenames(input, [&](const std::string& filename) -> std::optional<std::string> {
+    if (!hasFileExtension(filename, ".stl"))
+    {
+      return std::nullopt;
+    }
+    return get_replacement(filename);
+  });
+}
+
+std::filesystem::path convertMeshToOBJ(const shapes::Mesh& mesh, const std::filesystem::path& cache_directory,
+                                       bool convex_hull)
+{
+  if (mesh.vertex_count == 0 || mesh.triangle_count == 0)
+  {
+    throw std::runtime_error("Mesh has no triangles");
+  }
+  std::filesystem::create_directories(cache_directory);
+
+  std::string content(reinterpret_cast<const char*>(mesh.vertices), 3 * mesh.vertex_count * sizeof(double));
+  content.append(reinterpret_cast<const char*>(mesh.triangles), 3 * mesh.triangle_count * sizeof(unsigned int));
+  const auto content_hash = toHex(hashBytes(content));
+  const auto obj_path = cache_directory / (content_hash + ".obj");
+  if (!std::filesystem::exists(obj_path))
+  {
+    RCLCPP_DEBUG(getLogger(), "Writing mesh with %u triangles to '%s'", mesh.triangle_count, obj_path.c_str());
+    std::string obj = "# Converted from a planning scene mesh by moveit_drake\n";
+    char line[128];
+    for (unsigned int i = 0; i < mesh.vertex_count; ++i)
+    {
+      std::snprintf(line, sizeof(line), "v %.17g %.17g %.17g\n", mesh.vertices[3 * i], mesh.vertices[3 * i + 1],
+                    mesh.vertices[3 * i + 2]);
+      obj += line;
+    }
+    for (unsigned int i = 0; i < mesh.triangle_count; ++i)
+    {
+      std::snprintf(line, sizeof(line), "f %u %u %u\n", mesh.triangles[3 * i] + 1, mesh.triangles[3 * i + 1] + 1,
+                    mesh.triangles[3 * i + 2] + 1);
+      obj += line;
+    }
+    writeFileAtomically(obj_path, obj);
+  }
+  if (!convex_hull)
+  {
+    return obj_path;
+  }
+
+  const auto hull_path = cache_directory / (content_hash + ".hull.obj");
+  if (!std::filesystem::exists(hull_path))
+  {
+    // Drake throws for degenerate hulls, e.g. of planar meshes
+    const auto& hull = ::drake::geometry::Convex(obj_path.string()).GetConvexHull();
+    RCLCPP_DEBUG(getLogger(), "Writing convex hull with %d vertices to '%s'", hull.num_vertices(), hull_path.c_str());
+    std::string obj = "# Convex hull of a planning scene mesh by moveit_drake\n";
+    char line[128];
+    for (int i = 0; i < hull.num_vertices(); ++i)
+    {
+      const auto& vertex = hull.vertex(i);
+      std::snprintf(line, sizeof(line), "v %.17g %.17g %.17g\n", vertex.x(), vertex.y(), vertex.z());
+      obj += line;
+    }
+    for (int i = 0; i < hull.num_faces(); ++i)
+    {
+      const auto& face = hull.element(i);
+      obj += 'f';
+      for (int j = 0; j < face.num_vertices(); ++j)
+        obj += ' ' + std::to_string(face.vertex(j) + 1);
+      obj += '\n';
+    }
+    writeFileAtomically(hull_path, obj);
+  }
+  return hull_path;
+}
+}  // namespace moveit::drake
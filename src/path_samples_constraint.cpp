@@ -0,0 +1,177 @@
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+#include <drake/math/autodiff.h>
+#include <drake/math/autodiff_gradient.h>
+
+#include <ktopt_interface/path_samples_constraint.hpp>
+
+namespace ktopt_interface
+{
+PathSampleContexts::PathSampleContexts(const drake::systems::Context<double>& diagram_context)
+  : diagram_context_(diagram_context.Clone())
+{
+}
+
+drake::systems::Context<double>& PathSampleContexts::getDiagramContext()
+{
+  return *diagram_context_;
+}
+
+drake::systems::Context<double>& PathSampleContexts::getSampleContext(const std::size_t sample_index)
+{
+  while (sample_contexts_.size() <= sample_index)
+  {
+    sample_contexts_.push_back(diagram_context_->Clone());
+  }
+  return *sample_contexts_[sample_index];
+}
+
+PathSamplesConstraint::PathSamplesConstraint(const drake::systems::Diagram<double>& diagram,
+                                             const drake::multibody::MultibodyPlant<double>& plant,
+                                             PathSampleContexts& sample_contexts,
+                                             const drake::math::BsplineBasis<double>& basis,
+                                             const std::vector<double>& path_parameters,
+                                             const SampleConstraintFactory& make_sample_constraint,
+                                             std::shared_ptr<ThreadPool> thread_pool)
+  : PathSamplesConstraint(
+        plant.num_positions(), basis.num_basis_functions(),
+        makeSamples(diagram, plant, sample_contexts, basis, path_parameters, make_sample_constraint),
+        std::move(thread_pool))
+{
+}
+
+PathSamplesConstraint::PathSamplesConstraint(const int num_positions, const int num_control_points,
+                                             Samples&& samples, std::shared_ptr<ThreadPool> thread_pool)
+  : drake::solvers::Constraint(static_cast<int>(samples.lower_bound.size()), num_positions * num_control_points,
+                               samples.lower_bound, samples.upper_bound, "path samples")
+  , num_positions_(num_positions)
+  , samples_(std::move(samples.samples))
+  , thread_pool_(std::move(thread_pool))
+{
+  // Each output only depends on the control points that are active at its sample
+  std::vector<std::pair<int, int>> gradient_sparsity_pattern;
+  for (const auto& sample : samples_)
+  {
+    for (int row = 0; row < sample.constraint->num_constraints(); ++row)
+    {
+      for (const int control_point_index : sample.control_point_indices)
+      {
+        for (int i = 0; i < num_positions_; ++i)
+          gradient_sparsity_pattern.emplace_back(sample.output_offset + row, control_point_index * num_positions_ + i);
+      }
+    }
+  }
+  SetGradientSparsityPattern(gradient_sparsity_pattern);
+}
+
+PathSamplesConstraint::Samples PathSamplesConstraint::makeSamples(
+    const drake::systems::Diagram<double>& diagram, const drake::multibody::MultibodyPlant<double>& plant,
+    PathSampleContexts& sample_contexts, const drake::math::BsplineBasis<double>& basis,
+    const std::vector<double>& path_parameters, const SampleConstraintFactory& make_sample_constraint)
+{
+  Samples samples;
+  samples.samples.reserve(path_parameters.size());
+  std::vector<double> lower_bound;
+  std::vector<double> upper_bound;
+  for (std::size_t i = 0; i < path_parameters.size(); ++i)
+  {
+    const double s = path_parameters[i];
+    Sample sample;
+    auto& plant_context = diagram.GetMutableSubsystemContext(plant, &sample_contexts.getSampleContext(i));
+    sample.constraint = make_sample_constraint(&plant_context);
+    if (sample.constraint->num_vars() != plant.num_positions())
+    {
+      throw std::invalid_argument("Path sample constraints must be evaluated on the plant positions, got " +
+                                  std::to_string(sample.constraint->num_vars()) + " variables");
+    }
+    sample.control_point_indices = basis.ComputeActiveBasisFunctionIndices(s);
+    for (const int control_point_index : sample.control_point_indices)
+      sample.basis_values.push_back(basis.EvaluateBasisFunctionI(control_point_index, s));
+    sample.output_offset = static_cast<int>(lower_bound.size());
+    lower_bound.insert(lower_bound.end(), sample.constraint->lower_bound().begin(),
+                       sample.constraint->lower_bound().end());
+    upper_bound.insert(upper_bound.end(), sample.constraint->upper_bound().begin(),
+                       sample.constraint->upper_bound().end());
+    samples.samples.push_back(std::move(sample));
+  }
+  samples.lower_bound = Eigen::Map<const Eigen::VectorXd>(lower_bound.data(), lower_bound.size());
+  samples.upper_bound = Eigen::Map<const Eigen::VectorXd>(upper_bound.data(), upper_bound.size());
+  return samples;
+}
+
+drake::solvers::VectorXDecisionVariable
+PathSamplesConstraint::getVariables(const drake::solvers::MatrixXDecisionVariable& control_points)
+{
+  // Control points are the columns of the matrix, so its column-major storage stacks them
+  return Eigen::Map<const drake::solvers::VectorXDecisionVariable>(control_points.data(), control_points.size());
+}
+
+void PathSamplesConstraint::interpolate(const Sample& sample, const Eigen::Ref<const Eigen::VectorXd>& x,
+                                        Eigen::VectorXd& q) const
+{
+  q.setZero(num_positions_);
+  for (std::size_t j = 0; j < sample.control_point_indices.size(); ++j)
+  {
+    q += sample.basis_values[j] * x.segment(sample.control_point_indices[j] * num_positions_, num_positions_);
+  }
+}
+
+void PathSamplesConstraint::forEachSample(const std::function<void(std::size_t)>& evaluate) const
+{
+  if (thread_pool_ && samples_.size() > 1)
+  {
+    thread_pool_->parallelFor(samples_.size(), evaluate);
+    return;
+  }
+  for (std::size_t i = 0; i < samples_.size(); ++i)
+  {
+    evaluate(i);
+  }
+}
+
+void PathSamplesConstraint::DoEval(const Eigen::Ref<const Eigen::VectorXd>& x, Eigen::VectorXd* y) const
+{
+  // Every sample writes its own segment of the output
+  y->resize(num_constraints());
+  forEachSample([&](const std::size_t i) {
+    const auto& sample = samples_[i];
+    Eigen::VectorXd q;
+    Eigen::VectorXd sample_y;
+    interpolate(sample, x, q);
+    sample.constraint->Eval(q, &sample_y);
+    y->segment(sample.output_offset, sample_y.size()) = sample_y;
+  });
+}
+
+void PathSamplesConstraint::DoEval(const Eigen::Ref<const drake::AutoDiffVecXd>& x, drake::AutoDiffVecXd* y) const
+{
+  // Samples are evaluated with gradients with respect to their plant positions only, which are then chained with the
+  // gradient of the positions with respect to the control points
+  const Eigen::VectorXd x_value = drake::math::ExtractValue(x);
+  const Eigen::MatrixXd x_gradient = drake::math::ExtractGradient(x);
+  y->resize(num_constraints());
+  forEachSample([&](const std::size_t i) {
+    const auto& sample = samples_[i];
+    Eigen::VectorXd q;
+    interpolate(sample, x_value, q);
+    Eigen::MatrixXd q_gradient = Eigen::MatrixXd::Zero(num_positions_, x_gradient.cols());
+    for (std::size_t j = 0; j < sample.control_point_indices.size(); ++j)
+    {
+      q_gradient += sample.basis_values[j] *
+                    x_gradient.middleRows(sample.control_point_indices[j] * num_positions_, num_positions_);
+    }
+    drake::AutoDiffVecXd sample_y;
+    sample.constraint->Eval(drake::math::InitializeAutoDiff(q), &sample_y);
+    y->segment(sample.output_offset, sample_y.size()) = drake::math::InitializeAutoDiff(
+        drake::math::ExtractValue(sample_y), drake::math::ExtractGradient(sample_y, num_positions_) * q_gradient);
+  });
+}
+
+void PathSamplesConstraint::DoEval(const Eigen::Ref<const drake::VectorX<drake::symbolic::Variable>>& /*x*/,
+                                   drake::VectorX<drake::symbolic::Expression>* /*y*/) const
+{
+  throw std::logic_error("PathSamplesConstraint does not support symbolic evaluation");
+}
+}  // namespace ktopt_interface
@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <memory>
+
+#include <ktopt_interface/thread_pool.hpp>
+
+namespace ktopt_interface
+{
+ThreadPool::ThreadPool(std::size_t num_threads)
+{
+  if (num_threads == 0)
+  {
+    num_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  threads_.reserve(num_threads);
+  for (std::size_t i = 0; i < num_threads; ++i)
+  {
+    threads_.emplace_back([this] { run(); });
+  }
+}
+
+ThreadPool::~ThreadPool()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  condition_.notify_all();
+  for (auto& thread : threads_)
+  {
+    thread.join();
+  }
+}
+
+std::size_t ThreadPool::size() const
+{
+  return threads_.size();
+}
+
+void ThreadPool::parallelFor(std::size_t n, const std::function<void(std::size_t)>& body)
+{
+  // Helpers are only queued for idle workers, so a loop on a busy pool, e.g. nested in a parallel solve, runs inline
+  // without touching the queue
+  if (n > 1 && num_idle_.load(std::memory_order_relaxed) > 0 && runOnWorkers(n, body))
+  {
+    return;
+  }
+
+  std::exception_ptr error;
+  for (std::size_t i = 0; i < n; ++i)
+  {
+    try
+    {
+      body(i);
+    }
+    catch (...)
+    {
+      if (!error)
+      {
+        error = std::current_exception();
+      }
+    }
+  }
+  if (error)
+  {
+    std::rethrow_exception(error);
+  }
+}
+
+bool ThreadPool::runOnWorkers(std::size_t n, const std::function<void(std::size_t)>& body)
+{
+  // Shared with the helper tasks, which may only get to run after this loop has finished
+  struct LoopState
+  {
+    std::atomic<std::size_t> next{ 0 };
+    std::size_t n = 0;
+    const std::function<void(std::size_t)>* body = nullptr;
+    std::mutex mutex;
+    std::condition_variable done_condition;
+    std::size_t num_done = 0;
+    std::exception_ptr error;
+  };
+  auto state = std::make_shared<LoopState>();
+  state->n = n;
+  state->body = &body;
+
+  // Iterations are only claimed by running threads, so everything claimed is eventually finished
+  const auto work = [state] {
+    for (std::size_t i = state->next++; i < state->n; i = state->next++)
+    {
+      std::exception_ptr error;
+      try
+      {
+        (*state->body)(i);
+      }
+      catch (...)
+      {
+        error = std::current_exception();
+      }
+
+      std::lock_guard<std::mutex> lock(state->mutex);
+      if (error && !state->error)
+      {
+        state->error = error;
+      }
+      if (++state->num_done == state->n)
+      {
+        state->done_condition.notify_all();
+      }
+    }
+  };
+
+  std::size_t num_helpers = 0;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Queued tasks will be picked up by idle workers as well
+    const std::size_t num_idle = num_idle_.load(std::memory_order_relaxed);
+    const std::size_t num_available = num_idle > tasks_.size() ? num_idle - tasks_.size() : 0;
+    num_helpers = std::min(num_available, n - 1);
+    for (std::size_t i = 0; i < num_helpers; ++i)
+    {
+      tasks_.emplace_back(work);
+    }
+  }
+  if (num_helpers == 0)
+  {
+    return false;
+  }
+  for (std::size_t i = 0; i < num_helpers; ++i)
+  {
+    condition_.notify_one();
+  }
+
+  work();
+
+  std::unique_lock<std::mutex> lock(state->mutex);
+  state->done_condition.wait(lock, [&state] { return state->num_done == state->n; });
+  if (state->error)
+  {
+    std::rethrow_exception(state->error);
+  }
+  return true;
+}
+
+void ThreadPool::run()
+{
+  while (true)
+  {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      num_idle_.fetch_add(1, std::memory_order_relaxed);
+      condition_.wait(lock, [this] { return stop_ || !tasks_.empty(); });
+      num_idle_.fetch_sub(1, std::memory_order_relaxed);
+      if (stop_)
+      {
+        return;
+      }
+      task = std::move(tasks_.front());
+      tasks_.pop_front();
+    }
+    task();
+  }
+}
+}  // namespace ktopt_interface
@@ -0,0 +1,106 @@
+#include <future>
+
+#include <drake/geometry/meshcat_params.h>
+
+#include <moveit/utils/logger.hpp>
+
+#include <ktopt_interface/visualization_worker.hpp>
+
+namespace ktopt_interface
+{
+namespace
+{
+/// @brief Helper function that returns the logger instance associated with the visualization worker.
+/// @return The logger instance.
+rclcpp::Logger getLogger()
+{
+  return moveit::getLogger("moveit.planners.ktopt_interface.visualization_worker");
+}
+}  // namespace
+
+VisualizationWorker::VisualizationWorker()
+{
+  std::promise<std::shared_ptr<drake::geometry::Meshcat>> meshcat_promise;
+  auto meshcat_future = meshcat_promise.get_future();
+  thread_ = std::thread([this, &meshcat_promise] {
+    try
+    {
+      meshcat_promise.set_value(std::make_shared<drake::geometry::Meshcat>(drake::geometry::MeshcatParams()));
+    }
+    catch (...)
+    {
+      meshcat_promise.set_exception(std::current_exception());
+      return;
+    }
+    run();
+  });
+
+  try
+  {
+    meshcat_ = meshcat_future.get();
+  }
+  catch (...)
+  {
+    thread_.join();
+    throw;
+  }
+}
+
+VisualizationWorker::~VisualizationWorker()
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  condition_.notify_one();
+  thread_.join();
+}
+
+std::shared_ptr<drake::geometry::Meshcat> VisualizationWorker::getMeshcat() const
+{
+  return meshcat_;
+}
+
+void VisualizationWorker::post(std::function<void()> job)
+{
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    jobs_.push_back(std::move(job));
+  }
+  condition_.notify_one();
+}
+
+void VisualizationWorker::run()
+{
+  while (true)
+  {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_.wait(lock, [this] { return stop_ || !jobs_.empty(); });
+      if (stop_)
+      {
+        // Discarded jobs may own references to the Meshcat instance, e.g. through a diagram, so they are destroyed
+        // on this thread before the instance itself
+        auto discarded_jobs = std::move(jobs_);
+        jobs_.clear();
+        lock.unlock();
+        discarded_jobs.clear();
+        meshcat_.reset();
+        return;
+      }
+      job = std::move(jobs_.front());
+      jobs_.pop_front();
+    }
+
+    try
+    {
+      job();
+    }
+    catch (const std::exception& e)
+    {
+      RCLCPP_ERROR(getLogger(), "Visualization job failed: %s", e.what());
+    }
+  }
+}
+}  // namespace ktopt_interface